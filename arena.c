@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "arena.h"
+#include "pool.h"
+
+static pool_t chunk_pool = POOL_INITIALIZER(ARENA_CHUNK_SIZE, 64);
+
+#define CHUNK_HEADER_SIZE ((sizeof(arena_chunk_t) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+
+void arena_init(arena_t *arena) {
+    arena->cursor = arena->initial.bytes;
+    arena->end = arena->initial.bytes + ARENA_INLINE_SIZE;
+    arena->chunks = NULL;
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    if(size <= (size_t)(arena->end - arena->cursor)) {
+        void *ptr = arena->cursor;
+        arena->cursor += size;
+        return ptr;
+    }
+
+    // Standard chunks are recycled, oversized ones come straight from malloc
+    arena_chunk_t *chunk;
+    size_t chunk_size = CHUNK_HEADER_SIZE + size;
+    if(chunk_size <= ARENA_CHUNK_SIZE) {
+        chunk_size = ARENA_CHUNK_SIZE;
+        chunk = pool_get(&chunk_pool);
+    }
+    else {
+        chunk = malloc(chunk_size);
+    }
+    if(chunk == NULL) {
+        perror("arena_alloc");
+        return NULL;
+    }
+    chunk->size = chunk_size;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+
+    unsigned char *data = (unsigned char *)chunk + CHUNK_HEADER_SIZE;
+    arena->cursor = data + size;
+    arena->end = (unsigned char *)chunk + chunk_size;
+    return data;
+}
+
+void arena_release(arena_t *arena) {
+    arena_chunk_t *chunk = arena->chunks, *next;
+    while(chunk != NULL) {
+        next = chunk->next;
+        if(chunk->size == ARENA_CHUNK_SIZE)
+            pool_put(&chunk_pool, chunk);
+        else
+            free(chunk);
+        chunk = next;
+    }
+    arena_init(arena);
+}
@@ -0,0 +1,34 @@
+#ifndef HTTP2COAP_ARENA_H
+#define HTTP2COAP_ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_INLINE_SIZE 512       /* enough for the options of a typical request */
+#define ARENA_CHUNK_SIZE 4096       /* chunks of this size are recycled through a pool */
+#define ARENA_ALIGNMENT 16
+
+typedef struct arena_chunk_t {
+    struct arena_chunk_t *next;
+    size_t size;
+} arena_chunk_t;
+
+// Bump allocator for everything that lives exactly as long as one exchange:
+// nothing is freed individually, arena_release() drops it all at once
+typedef struct {
+    unsigned char *cursor;
+    unsigned char *end;
+    arena_chunk_t *chunks;
+    union {
+        long long l;
+        double d;
+        long double ld;
+        void *p;
+        unsigned char bytes[ARENA_INLINE_SIZE];
+    } initial;
+} arena_t;
+
+void arena_init(arena_t *arena);
+void *arena_alloc(arena_t *arena, size_t size);
+void arena_release(arena_t *arena);
+
+#endif //HTTP2COAP_ARENA_H
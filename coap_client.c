@@ -1,18 +1,45 @@
 #include <netdb.h>
 #include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
 #include <arpa/inet.h>
+#include <sys/select.h>
 #include <coap/str.h>
 #include <coap/address.h>
 #include "coap_client.h"
+#include "context.h"
+#include "exchange.h"
+#include "scheduler.h"
+#include "multicast.h"
+#include "resource_directory.h"
+#include "coap_handler.h"
+#include "pool.h"
+#include "coap_io.h"
+#include "http_status.h"
 
-coap_context_t *coap_context = NULL;
+// A received PDU lives in a block behind its reference count, responses handed to the caller keep theirs
+typedef struct {
+    volatile int references;
+} received_pdu_header_t;
+#define RECEIVED_PDU_OFFSET 16
+#define RECEIVED_PDU_BLOCK_SIZE 2048
+typedef char received_pdu_block_is_big_enough[
+        (RECEIVED_PDU_OFFSET + sizeof(coap_pdu_t) + COAP_MAX_PDU_SIZE <= RECEIVED_PDU_BLOCK_SIZE) ? 1 : -1];
 
-int resolve_address(const str *server, struct sockaddr *dst) {
+static void coap_client_read(http2coap_context_t *context);
+
+static pool_t received_pdu_pool = POOL_INITIALIZER(RECEIVED_PDU_BLOCK_SIZE, HTTP2COAP_MAX_IN_FLIGHT);
+
+int resolve_address(const str *server, struct sockaddr_in *dst, int max) {
 
     struct addrinfo *res, *ainfo;
     struct addrinfo hints;
-    static char addrstr[256];
-    int error, len=-1;
+    char addrstr[256];
+    int error, count = 0;
 
     memset(addrstr, 0, sizeof(addrstr));
     if(server->length)
@@ -20,32 +47,35 @@ int resolve_address(const str *server, struct sockaddr *dst) {
     else
         memcpy(addrstr, "localhost", 9);
 
+    // The socket of the CoAP thread is bound to 0.0.0.0, only IPv4 upstreams can be reached from it
     memset ((char *)&hints, 0, sizeof(hints));
     hints.ai_socktype = SOCK_DGRAM;
-    hints.ai_family = AF_UNSPEC;
+    hints.ai_family = AF_INET;
 
     error = getaddrinfo(addrstr, NULL, &hints, &res);
 
     if (error != 0) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(error));
-        return error;
+        fprintf(stderr, "getaddrinfo: %s: %s\n", addrstr, gai_strerror(error));
+        return -1;
     }
 
-    for(ainfo = res; ainfo != NULL; ainfo = ainfo->ai_next) {
-        switch (ainfo->ai_family) {
-            case AF_INET6:
-            case AF_INET:
-                len = ainfo->ai_addrlen;
-                memcpy(dst, ainfo->ai_addr, len);
-                goto finish;
-            default:
-                ;
-        }
+    for(ainfo = res; ainfo != NULL && count < max; ainfo = ainfo->ai_next) {
+        if(ainfo->ai_family != AF_INET || ainfo->ai_addrlen != sizeof(struct sockaddr_in))
+            continue;
+        const struct sockaddr_in *address = (const struct sockaddr_in *)ainfo->ai_addr;
+        int duplicate = 0;
+        for(int i = 0; i < count; i++)
+            duplicate |= dst[i].sin_addr.s_addr == address->sin_addr.s_addr;
+        if(!duplicate)
+            dst[count++] = *address;
     }
 
-    finish:
     freeaddrinfo(res);
-    return len;
+    if(count == 0) {
+        fprintf(stderr, "error: no IPv4 address for %s\n", addrstr);
+        return -1;
+    }
+    return count;
 }
 
 coap_context_t *coap_create_context(const char *node, const char *port)
@@ -111,10 +141,14 @@ static unsigned char _token_data[8];
 unsigned char msgtype = COAP_MESSAGE_CON; /* usually, requests are sent confirmable */
 str the_token = { 0, _token_data };
 
-coap_pdu_t *coap_new_request(coap_context_t *ctx, method_t m, coap_list_t **options, unsigned char *data, size_t length) {
+coap_pdu_t *coap_new_request(coap_context_t *ctx, method_t m, const str *token, coap_list_t **options,
+                             unsigned char *data, size_t length) {
     coap_pdu_t *pdu;
     coap_list_t *opt;
 
+    if(token == NULL)
+        token = &the_token;
+
     if(!(pdu = coap_new_pdu())) {
         fprintf(stderr, "coap_new_pdu failed\n");
         return NULL;
@@ -124,8 +158,8 @@ coap_pdu_t *coap_new_request(coap_context_t *ctx, method_t m, coap_list_t **opti
     pdu->hdr->id = coap_new_message_id(ctx);
     pdu->hdr->code = m;
 
-    pdu->hdr->token_length = (unsigned int)the_token.length;
-    if(!coap_add_token(pdu, the_token.length, the_token.s)) {
+    pdu->hdr->token_length = (unsigned int)token->length;
+    if(!coap_add_token(pdu, token->length, token->s)) {
         fprintf(stderr, "cannot add token to request\n");
     }
 
@@ -142,9 +176,486 @@ coap_pdu_t *coap_new_request(coap_context_t *ctx, method_t m, coap_list_t **opti
         }
     }
 
-    if(length) {
-        coap_add_data(pdu, (unsigned int)length, data);
+    // Options come first, a long path leaves less room for the payload: better no request than an empty one
+    if(length && !coap_add_data(pdu, (unsigned int)length, data)) {
+        fprintf(stderr, "request payload of %zu bytes does not fit in the PDU\n", length);
+        coap_delete_pdu(pdu);
+        return NULL;
+    }
+
+    return pdu;
+}
+
+void coap_client_wakeup(http2coap_context_t *context) {
+    if(context->wakeup_pipe[1] != -1) {
+        char c = 0;
+        if(write(context->wakeup_pipe[1], &c, 1) == -1 && errno != EAGAIN)
+            perror("write");
+    }
+}
+
+// The in flight exchange a request or its acknowledgement belongs to, NULL if there is none
+static exchange_t *exchange_in_flight(http2coap_context_t *context, unsigned short message_id) {
+    for(int i = 0; i < IN_FLIGHT_SLOTS; i++) {
+        if(context->in_flight[i].exchange != NULL && context->in_flight[i].message_id == message_id)
+            return context->in_flight[i].exchange;
+    }
+    return NULL;
+}
+
+// Hedges do not hold a slot of the upstream, the hedge rate cap bounds them
+static unsigned int exchanges_in_flight(http2coap_context_t *context) {
+    unsigned int count = 0;
+    for(int i = 0; i < IN_FLIGHT_SLOTS; i++) {
+        if(context->in_flight[i].exchange != NULL && !context->in_flight[i].hedge)
+            count++;
+    }
+    return count;
+}
+
+// Forget one side of a hedged exchange, returns 0 when it was the only request of its exchange
+static int forget_request(http2coap_context_t *context, unsigned short message_id) {
+    in_flight_t *request = NULL;
+    int others = 0;
+    exchange_t *exchange = exchange_in_flight(context, message_id);
+    for(int i = 0; i < IN_FLIGHT_SLOTS; i++) {
+        if(context->in_flight[i].exchange != exchange)
+            continue;
+        if(context->in_flight[i].message_id == message_id)
+            request = &context->in_flight[i];
+        else
+            others++;
+    }
+    if(others == 0 || request == NULL)
+        return 0;
+    request->exchange = NULL;
+    return 1;
+}
+
+// Build a CoAP request for the exchange and put it on the wire, returns why it failed or NULL
+static const char *send_request(exchange_t *exchange, const struct sockaddr_in *destination, int hedge) {
+    http2coap_context_t *context = exchange->context;
+    coap_context_t *coap_context = context->coap_context;
+
+    // Create packet
+    coap_pdu_t *pdu;
+    if(!(pdu = coap_new_request(coap_context, exchange->method, NULL, &exchange->options,
+                                exchange->payload, exchange->payload_length)))
+        return "coap_new_request: request creation failed\n";
+    unsigned short message_id = pdu->hdr->id;
+    TRACE_EVENT(exchange, hedge ? "hedge_pdu_built" : "pdu_built");
+
+    // Create destination address
+    coap_address_t destination_address;
+    memcpy(&destination_address.addr.sin, destination, sizeof(*destination));
+    destination_address.size = sizeof(*destination);
+
+    printf("COAP %13s:%-5u <- %s",
+           inet_ntoa((&destination_address.addr.sin)->sin_addr),
+           ntohs((&destination_address.addr.sin)->sin_port), hedge ? "(hedge) " : "");
+    coap_show_pdu(pdu);
+
+    // Send the message to the queue
+    coap_tid_t tid = coap_send_confirmed(coap_context, coap_context->endpoint, &destination_address, pdu);
+    if(tid == COAP_INVALID_TID)
+        return "coap_send_confirmed: could not send CoAP message\n";
+    if(hedge)
+        exchange->hedge_tid = tid;
+    else
+        exchange->tid = tid;
+    TRACE_EVENT(exchange, hedge ? "hedge" : "send");
+
+    // Keep a trace of this exchange so we can complete it when the response arrives
+    for(int i = 0; i < IN_FLIGHT_SLOTS; i++) {
+        if(context->in_flight[i].exchange == NULL) {
+            context->in_flight[i].message_id = message_id;
+            context->in_flight[i].exchange = exchange;
+            context->in_flight[i].hedge = hedge;
+            coap_ticks(&context->in_flight[i].sent_at);
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Send an admitted exchange to the upstream
+static void send_exchange(exchange_t *exchange) {
+    http2coap_context_t *context = exchange->context;
+
+    const char *error = send_request(exchange, &context->destination, 0);
+    if(error != NULL) {
+        exchange_fail(exchange, HTTP_BAD_GATEWAY, error);
+        return;
+    }
+    exchange->state = EXCHANGE_IN_FLIGHT;
+
+    // Only idempotent requests may reach the upstream twice
+    if(context->config.hedge_percentile != 0 && context->replica_count != 0 && exchange->method == COAP_REQUEST_GET)
+        hedge_count_request(&context->hedge, context->config.hedge_max_percent);
+    else
+        exchange->hedged = 1;
+}
+
+// Duplicate to a replica the requests that have waited longer than most responses take, returns the ticks
+// until the next one is due
+static coap_tick_t hedge_exchanges(http2coap_context_t *context, coap_tick_t now, coap_tick_t max_wait) {
+    coap_tick_t delay = context->hedge.delay;
+    if(delay == 0)
+        return max_wait;
+
+    for(int i = 0; i < IN_FLIGHT_SLOTS; i++) {
+        exchange_t *exchange = context->in_flight[i].exchange;
+        if(exchange == NULL || exchange->hedged)
+            continue;
+        coap_tick_t due = context->in_flight[i].sent_at + delay;
+        if(due > now) {
+            if(due - now < max_wait)
+                max_wait = due - now;
+            continue;
+        }
+
+        // Whatever the cap says, an exchange gets a single chance
+        exchange->hedged = 1;
+        if(hedge_take(&context->hedge)) {
+            const struct sockaddr_in *replica = &context->replicas[context->next_replica++ % context->replica_count];
+            const char *error = send_request(exchange, replica, 1);
+            if(error != NULL)
+                fputs(error, stderr);
+        }
+    }
+    return max_wait;
+}
+
+// Whether the client of a waiting request has hung up, HTTP servers do not watch suspended connections
+static int client_gone(exchange_t *exchange) {
+    if(exchange->client_fd < 0)
+        return 0;
+    char c;
+    ssize_t result = recv(exchange->client_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return result == 0 || (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+typedef struct {
+    coap_tick_t now;
+    int check_clients;
+} sweep_context_t;
+
+static int should_drop_queued(exchange_t *exchange, void *arg) {
+    sweep_context_t *sweep = arg;
+    return exchange->abandoned || exchange->deadline <= sweep->now
+           || (sweep->check_clients && client_gone(exchange));
+}
+
+#define CLIENT_CHECK_INTERVAL (COAP_TICKS_PER_SECOND / 5)
+
+// Drop exchanges whose deadline passed or whose client is gone, returns the ticks until the next deadline
+static coap_tick_t expire_exchanges(http2coap_context_t *context, coap_tick_t now, coap_tick_t max_wait) {
+    sweep_context_t sweep = { now, now - context->last_client_check >= CLIENT_CHECK_INTERVAL };
+    if(sweep.check_clients)
+        context->last_client_check = now;
+
+    // Queued ones never reach the upstream
+    exchange_t *dropped = scheduler_sweep(&context->scheduler, should_drop_queued, &sweep), *next;
+    for(exchange_t *exchange = dropped; exchange != NULL; exchange = next) {
+        next = exchange->next;
+        exchange->next = NULL;
+        if(exchange->abandoned || exchange->deadline > now)
+            exchange_cancel(exchange);
+        else
+            exchange_fail(exchange, HTTP_GATEWAY_TIMEOUT, "Deadline expired while waiting for the CoAP host\n");
+    }
+
+    // In flight ones stop being retransmitted
+    int waiting = 0;
+    for(int i = 0; i < IN_FLIGHT_SLOTS; i++) {
+        exchange_t *exchange = context->in_flight[i].exchange;
+        if(exchange == NULL)
+            continue;
+        waiting = 1;
+        if(exchange->abandoned || (sweep.check_clients && client_gone(exchange)))
+            exchange_cancel(exchange);
+        else if(exchange->deadline <= now)
+            exchange_fail(exchange, HTTP_GATEWAY_TIMEOUT, "CoAP service took too long to respond\n");
+        else if(exchange->deadline - now < max_wait)
+            max_wait = exchange->deadline - now;
+    }
+
+    // Keep an eye on the clients while they wait
+    if(waiting && max_wait > CLIENT_CHECK_INTERVAL)
+        max_wait = CLIENT_CHECK_INTERVAL;
+    return max_wait;
+}
+
+static void *coap_client_loop(void *arg) {
+    http2coap_context_t *context = arg;
+    coap_context_t *coap_context = context->coap_context;
+    fd_set readfds;
+    coap_tick_t now;
+    coap_queue_t *next_pdu;
+    exchange_t *exchange;
+
+    // Whatever this thread sends goes through the batch of the context
+    coap_io_attach(&context->io, coap_context);
+
+    while(context->coap_thread_running) {
+        // Admit queued exchanges in fair order as long as the upstream has room for them
+        while(exchanges_in_flight(context) < context->config.max_in_flight
+              && (exchange = scheduler_next(&context->scheduler)) != NULL) {
+            coap_ticks(&now);
+            if(exchange->abandoned)
+                exchange_cancel(exchange);
+            else if(exchange->deadline <= now)
+                exchange_fail(exchange, HTTP_GATEWAY_TIMEOUT, "Deadline expired while waiting for the CoAP host\n");
+            // Fan-out requests do not go to the upstream and never hold one of its slots
+            else if(exchange->multicast_route)
+                multicast_start(exchange, ntohs(context->destination.sin_port));
+            else
+                send_exchange(exchange);
+        }
+
+        next_pdu = coap_peek_next(coap_context);
+
+        coap_ticks(&now);
+        while(next_pdu && next_pdu->t <= now - coap_context->sendqueue_basetime) {
+            printf("COAP %13s:%-5u <- (retransmit) ",
+                   inet_ntoa((&next_pdu->remote.addr.sin)->sin_addr),
+                   ntohs((&next_pdu->remote.addr.sin)->sin_port));
+            coap_show_pdu(next_pdu->pdu);
+            if(trace_sample_rate > 0 && (exchange = exchange_in_flight(context, next_pdu->pdu->hdr->id)) != NULL)
+                TRACE_EVENT(exchange, "retransmit");
+
+            coap_retransmit(coap_context, coap_pop_next(coap_context));
+            next_pdu = coap_peek_next(coap_context);
+        }
+
+        // Sleep until the next retransmission or deadline, or until we are woken up
+        coap_tick_t max_wait = expire_exchanges(context, now, COAP_TICKS_PER_SECOND);
+        max_wait = hedge_exchanges(context, now, max_wait);
+        max_wait = multicast_expire(&context->multicast, now, max_wait);
+        max_wait = resource_directory_refresh(context, now, max_wait);
+        if(next_pdu) {
+            coap_tick_t next_retransmit = next_pdu->t + coap_context->sendqueue_basetime;
+            coap_tick_t wait = next_retransmit > now ? next_retransmit - now : 0;
+            if(wait < max_wait)
+                max_wait = wait;
+        }
+        // Everything sent during this iteration leaves at once
+        coap_io_flush(&context->io, coap_context);
+
+        struct timeval tv;
+        tv.tv_sec = max_wait / COAP_TICKS_PER_SECOND;
+        tv.tv_usec = (max_wait % COAP_TICKS_PER_SECOND) * 1000000 / COAP_TICKS_PER_SECOND;
+
+        FD_ZERO(&readfds);
+        FD_SET(coap_context->sockfd, &readfds);
+        FD_SET(context->wakeup_pipe[0], &readfds);
+        int nfds = multicast_fill_fdset(&context->multicast, &readfds,
+                                        coap_context->sockfd > context->wakeup_pipe[0]
+                                        ? coap_context->sockfd : context->wakeup_pipe[0]) + 1;
+
+        int result = select(nfds, &readfds, 0, 0, &tv);
+
+        if(result < 0) {   /* error */
+            if(errno != EINTR)
+                perror("select");
+        }
+        else if(result > 0) {
+            if(FD_ISSET(coap_context->sockfd, &readfds)) {
+                coap_client_read(context);       /* read received data */
+            }
+            multicast_read(&context->multicast, &readfds);
+            if(FD_ISSET(context->wakeup_pipe[0], &readfds)) {
+                char drain[64];
+                while(read(context->wakeup_pipe[0], drain, sizeof(drain)) > 0);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+int coap_client_start(http2coap_context_t *context) {
+    if(pipe(context->wakeup_pipe) != 0) {
+        perror("pipe");
+        context->wakeup_pipe[0] = context->wakeup_pipe[1] = -1;
+        return -1;
+    }
+    fcntl(context->wakeup_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(context->wakeup_pipe[1], F_SETFL, O_NONBLOCK);
+
+    srandom((unsigned int)time(NULL) ^ (unsigned int)getpid());
+    context->coap_thread_running = 1;
+    int error = pthread_create(&context->coap_thread, NULL, coap_client_loop, context);
+    if(error != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(error));
+        context->coap_thread_running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+static int should_drop_any(exchange_t *exchange, void *arg) {
+    return 1;
+}
+
+void coap_client_stop(http2coap_context_t *context) {
+    if(!context->coap_thread_running)
+        return;
+    context->coap_thread_running = 0;
+    coap_client_wakeup(context);
+    pthread_join(context->coap_thread, NULL);
+    close(context->wakeup_pipe[0]);
+    close(context->wakeup_pipe[1]);
+    context->wakeup_pipe[0] = context->wakeup_pipe[1] = -1;
+
+    // Nothing will answer what is still queued or in flight: abandoned exchanges are freed here, the callers of
+    // the others are told and release them as usual
+    exchange_t *dropped = scheduler_sweep(&context->scheduler, should_drop_any, NULL), *next;
+    for(exchange_t *exchange = dropped; exchange != NULL; exchange = next) {
+        next = exchange->next;
+        exchange->next = NULL;
+        exchange_cancel(exchange);
+    }
+    for(int i = 0; i < IN_FLIGHT_SLOTS; i++) {
+        if(context->in_flight[i].exchange != NULL)
+            exchange_cancel(context->in_flight[i].exchange);
+    }
+    // Readers of a fan-out get the end of their array with what was collected so far
+    multicast_close_all(&context->multicast);
+
+    for(int i = 0; i < COAP_IO_BATCH; i++) {
+        if(context->receive_pdus[i] != NULL)
+            received_pdu_release(context->receive_pdus[i]);
+        context->receive_pdus[i] = NULL;
     }
+}
 
+static coap_pdu_t *received_pdu_get(void) {
+    received_pdu_header_t *header = pool_get(&received_pdu_pool);
+    if(header == NULL)
+        return NULL;
+    header->references = 1;
+    coap_pdu_t *pdu = (coap_pdu_t *)((unsigned char *)header + RECEIVED_PDU_OFFSET);
+    // Only the descriptor is set up, unlike coap_pdu_clear(): recvmmsg() writes the datagram over the rest
+    memset(pdu, 0, sizeof(coap_pdu_t));
+    pdu->max_size = RECEIVED_PDU_BLOCK_SIZE - RECEIVED_PDU_OFFSET - sizeof(coap_pdu_t);
+    pdu->hdr = (coap_hdr_t *)((unsigned char *)pdu + sizeof(coap_pdu_t));
     return pdu;
-}
\ No newline at end of file
+}
+
+void received_pdu_retain(coap_pdu_t *pdu) {
+    received_pdu_header_t *header = (received_pdu_header_t *)((unsigned char *)pdu - RECEIVED_PDU_OFFSET);
+    __sync_add_and_fetch(&header->references, 1);
+}
+
+void received_pdu_release(coap_pdu_t *pdu) {
+    received_pdu_header_t *header = (received_pdu_header_t *)((unsigned char *)pdu - RECEIVED_PDU_OFFSET);
+    if(__sync_sub_and_fetch(&header->references, 1) == 0)
+        pool_put(&received_pdu_pool, header);
+}
+
+// recvfrom() wrote the datagram straight into pdu->hdr: validate it and locate the payload without copying
+static int coap_pdu_parse_in_place(coap_pdu_t *pdu, size_t length) {
+    if(length < sizeof(coap_hdr_t)
+       || pdu->hdr->version != COAP_DEFAULT_VERSION
+       || pdu->hdr->token_length > 8
+       || length < sizeof(coap_hdr_t) + pdu->hdr->token_length)
+        return 0;
+
+    pdu->length = (unsigned short)length;
+    pdu->data = NULL;
+
+    unsigned char *opt = pdu->hdr->token + pdu->hdr->token_length;
+    size_t left = length - sizeof(coap_hdr_t) - pdu->hdr->token_length;
+    coap_option_t option;
+    while(left && *opt != COAP_PAYLOAD_START) {
+        size_t option_size = coap_opt_parse(opt, left, &option);
+        if(option_size == 0)
+            return 0;
+        opt += option_size;
+        left -= option_size;
+    }
+    if(left) {
+        // a payload marker must be followed by a payload
+        if(left == 1)
+            return 0;
+        pdu->data = opt + 1;
+    }
+    return 1;
+}
+
+// Dispatch one received datagram, the PDU stays ours: libcoap does not free it once the handler returns
+static void coap_client_handle(http2coap_context_t *context, coap_pdu_t *pdu, coap_address_t *remote,
+                               size_t length) {
+    coap_context_t *coap_context = context->coap_context;
+
+    if(!coap_pdu_parse_in_place(pdu, length)) {
+        fprintf(stderr, "discarded invalid CoAP message\n");
+        return;
+    }
+
+    coap_tid_t id;
+    coap_queue_t *sent = NULL;
+    exchange_t *exchange;
+    coap_transaction_id(remote, pdu, &id);
+
+    switch(pdu->hdr->type) {
+        case COAP_MESSAGE_ACK:
+            // Stop retransmitting the request
+            coap_remove_from_queue(&coap_context->sendqueue, id, &sent);
+            if(trace_sample_rate > 0 && (exchange = exchange_in_flight(context, pdu->hdr->id)) != NULL)
+                TRACE_EVENT(exchange, "ack");
+            break;
+        case COAP_MESSAGE_RST:
+            coap_remove_from_queue(&coap_context->sendqueue, id, &sent);
+            // The other side of a hedged exchange may still answer
+            if((exchange = exchange_in_flight(context, pdu->hdr->id)) != NULL && !forget_request(context, pdu->hdr->id))
+                exchange_fail(exchange, HTTP_BAD_GATEWAY, "CoAP host reset the exchange\n");
+            break;
+        case COAP_MESSAGE_CON:
+            coap_send_ack(coap_context, coap_context->endpoint, remote, pdu);
+            break;
+        default:
+            break;
+    }
+
+    // Empty ACKs only announce a separate response
+    if(pdu->hdr->type != COAP_MESSAGE_RST && COAP_RESPONSE_CLASS(pdu->hdr->code) >= 2)
+        coap_response_handler(context, remote, sent ? sent->pdu : NULL, pdu, id);
+
+    if(sent)
+        coap_delete_node(sent);
+}
+
+// Under a flood, go back to retransmissions and admissions after this many batches
+#define MAX_READ_BATCHES 8
+
+// Our own version of coap_read(): drains the datagrams that are ready, a batch per recvmmsg().
+// The buffers recvmmsg() did not fill are kept for the next call, only the received ones are replaced.
+static void coap_client_read(http2coap_context_t *context) {
+    coap_pdu_t **pdus = context->receive_pdus;
+    coap_address_t sources[COAP_IO_BATCH];
+    size_t lengths[COAP_IO_BATCH];
+
+    for(int batch = 0; batch < MAX_READ_BATCHES; batch++) {
+        unsigned int count = 0;
+        while(count < COAP_IO_BATCH && (pdus[count] != NULL || (pdus[count] = received_pdu_get()) != NULL))
+            count++;
+        if(count == 0) {
+            perror("received_pdu_get");
+            return;
+        }
+
+        int received = coap_io_receive(&context->io, context->coap_context->sockfd, pdus, sources, lengths, count);
+        if(received < 0)
+            perror("recvmmsg");
+        for(int i = 0; i < received; i++) {
+            coap_client_handle(context, pdus[i], &sources[i], lengths[i]);
+            received_pdu_release(pdus[i]);
+            pdus[i] = NULL;
+        }
+        // A short batch means the socket is empty
+        if(received < (int)count)
+            break;
+    }
+}
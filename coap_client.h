@@ -1,15 +1,30 @@
 #ifndef HTTP2COAP_COAP_CLIENT_H
 #define HTTP2COAP_COAP_CLIENT_H
 
+#include <netinet/in.h>
 #include <coap/coap.h>
 #include "coap_list.h"
+#include "http2coap.h"
 
-extern coap_context_t *coap_context;
-
-int resolve_address(const str *server, struct sockaddr *dst);
+// Writes up to max IPv4 addresses of server to dst, returns how many or -1
+int resolve_address(const str *server, struct sockaddr_in *dst, int max);
 coap_context_t *coap_create_context(const char *node, const char *port);
 
 typedef unsigned char method_t;
-coap_pdu_t *coap_new_request(coap_context_t *ctx, method_t m, coap_list_t **options, unsigned char *data, size_t length);
+// token may be NULL to use the default (empty) token
+coap_pdu_t *coap_new_request(coap_context_t *ctx, method_t m, const str *token, coap_list_t **options,
+                             unsigned char *data, size_t length);
+
+// Received PDUs are read in place into pooled, reference counted buffers, so that their payload can be
+// handed to the caller without being copied. The CoAP thread holds one reference while dispatching.
+void received_pdu_retain(coap_pdu_t *pdu);
+void received_pdu_release(coap_pdu_t *pdu);
+
+// The CoAP thread of a context owns its coap_context: it sends admitted exchanges, retransmits and reads
+// responses
+int coap_client_start(http2coap_context_t *context);
+void coap_client_stop(http2coap_context_t *context);
+// Interrupt the CoAP thread so that it looks at the scheduler queues again
+void coap_client_wakeup(http2coap_context_t *context);
 
 #endif //HTTP2COAP_COAP_CLIENT_H
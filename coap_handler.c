@@ -1,52 +1,89 @@
 #include <stdio.h>
+#include <string.h>
 #include <arpa/inet.h>
 #include <coap/pdu.h>
 #include "coap_handler.h"
-#include "http_server.h"
-#include "http_reason_phrases.h"
+#include "context.h"
+#include "exchange.h"
+#include "resource_directory.h"
+#include "coap_client.h"
+#include "http_status.h"
 
-/** Returns a textual description of the method or response code. */
-static const char *msg_code_string(uint8_t c) {
-    static char *methods[] = { "0.00", "GET", "POST", "PUT", "DELETE", "PATCH" };
-    static char buf[5];
+/** Returns a textual description of the method or response code, formatted into buf when needed. */
+static const char *msg_code_string(uint8_t c, char *buf, size_t size) {
+    static const char *methods[] = { "0.00", "GET", "POST", "PUT", "DELETE", "PATCH" };
 
     if (c < sizeof(methods)/sizeof(char *)) {
         return methods[c];
     } else {
-        snprintf(buf, sizeof(buf), "%u.%02u", c >> 5, c & 0x1f);
+        snprintf(buf, size, "%u.%02u", c >> 5, c & 0x1f);
         return buf;
     }
 }
 
-// When we receive the CoAP response we build and send the HTTP response
-void coap_response_handler(struct coap_context_t *ctx, const coap_endpoint_t *local_interface,
-                           const coap_address_t *remote, coap_pdu_t *sent, coap_pdu_t *received, const coap_tid_t id) {
+// When we receive the CoAP response we translate it and hand it to the caller
+void coap_response_handler(http2coap_context_t *context, const coap_address_t *remote, coap_pdu_t *sent,
+                           coap_pdu_t *received, const coap_tid_t id) {
     printf("COAP %13s:%-5u -> ",
            inet_ntoa((&remote->addr.sin)->sin_addr),
            ntohs((&remote->addr.sin)->sin_port));
     coap_show_pdu(received);
 
-    for(int i = 0; i < MAX_HTTP_CONNECTIONS; i++) {
-        if(http_coap_pairs[i].message_id == received->hdr->id) {
-            struct MHD_Connection *connection = http_coap_pairs[i].connection;
-            size_t len = 0;
-            unsigned char *databuf = NULL;
+    for(int i = 0; i < IN_FLIGHT_SLOTS; i++) {
+        if(context->in_flight[i].exchange != NULL && context->in_flight[i].message_id == received->hdr->id) {
+            exchange_t *exchange = context->in_flight[i].exchange;
+            TRACE_EVENT(exchange, "response");
+
+            // Response times set the hedging delay, the first answer of a hedged exchange wins
+            coap_tick_t now;
+            coap_ticks(&now);
+            hedge_record_rtt(&context->hedge, now - context->in_flight[i].sent_at, context->config.hedge_percentile);
+            if(exchange->hedge_tid != COAP_INVALID_TID) {
+                hedge_count_win(&context->hedge, context->in_flight[i].hedge);
+                if(context->in_flight[i].hedge)
+                    TRACE_EVENT(exchange, "hedge_won");
+            }
+
+            // Responses to the proxy's own requests are not translated
+            if(exchange->coap_handler) {
+                exchange->coap_handler(exchange, received);
+                exchange->coap_handler = NULL;
+                exchange_complete(exchange, 0);
+                return;
+            }
 
-            struct MHD_Response *response = MHD_create_response_from_buffer(len, databuf, MHD_RESPMEM_MUST_COPY);
+            // Remember missing resources so that the next request for them does not reach the device
+            if(received->hdr->code == COAP_RESPONSE_404 && exchange->method == COAP_REQUEST_GET)
+                resource_directory_remember_missing(context, exchange->method, exchange->url);
 
+            size_t len = 0;
+            unsigned char *databuf = NULL;
             int read_result = coap_get_data(received, &len, &databuf);
             if(received->hdr->code == COAP_RESPONSE_CODE(205) && read_result == 0) {
-                coap_abort_to_http(connection, "coap_get_data: cannot read CoAP response data\n");
+                exchange_fail(exchange, HTTP_BAD_GATEWAY, "coap_get_data: cannot read CoAP response data\n");
+                return;
             }
 
-            static char tid_str[8];
+            // The body is the payload of the received PDU itself, which stays alive until the caller releases us
+            received_pdu_retain(received);
+            exchange->received = received;
+            exchange->response.body = databuf;
+            exchange->response.body_length = len;
+
+            char tid_str[8];
             snprintf(tid_str, sizeof(tid_str), "%u", ntohs(received->hdr->id));
-            MHD_add_response_header(response, "X-CoAP-Message-Id", tid_str);
-            MHD_add_response_header(response, "X-CoAP-Response-Code", msg_code_string(received->hdr->code));
+            exchange_add_header(exchange, "X-CoAP-Message-Id", tid_str);
+            char code[5];
+            exchange_add_header(exchange, "X-CoAP-Response-Code",
+                                msg_code_string(received->hdr->code, code, sizeof(code)));
+            char queue_delay_str[16];
+            snprintf(queue_delay_str, sizeof(queue_delay_str), "%lu",
+                     (unsigned long)exchange->queue_delay * 1000 / COAP_TICKS_PER_SECOND);
+            exchange_add_header(exchange, "X-Queue-Delay-Ms", queue_delay_str);
 
             // HTTP Content-Type
             const char *http_content_type;
-            int coap_content_format;
+            int coap_content_format = -1;
             coap_opt_iterator_t opt_iter;
             coap_opt_t *option;
             coap_option_iterator_init(received, &opt_iter, COAP_OPT_ALL);
@@ -70,39 +107,29 @@ void coap_response_handler(struct coap_context_t *ctx, const coap_endpoint_t *lo
                 case COAP_MEDIATYPE_APPLICATION_CBOR:           http_content_type = "application/cbor"; break;
                 default:                                        http_content_type = "unknown"; break;
             }
-            MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, http_content_type);
+            exchange_add_header(exchange, HTTP_HEADER_CONTENT_TYPE, http_content_type);
 
             // HTTP Code
             unsigned int http_code;
             switch(received->hdr->code) {
-                case COAP_RESPONSE_200:         http_code = MHD_HTTP_NO_CONTENT;            break; /* 2.00 OK */
-                case COAP_RESPONSE_201:         http_code = MHD_HTTP_CREATED;               break; /* 2.01 Created */
-                case COAP_RESPONSE_CODE(205):   http_code = MHD_HTTP_OK;                    break;
-                case COAP_RESPONSE_304:         http_code = MHD_HTTP_ACCEPTED;              break; /* 2.03 Valid */
-                case COAP_RESPONSE_400:         http_code = MHD_HTTP_BAD_REQUEST;           break; /* 4.00 Bad Request */
-                case COAP_RESPONSE_404:         http_code = MHD_HTTP_NOT_FOUND;             break; /* 4.04 Not Found */
-                case COAP_RESPONSE_405:         http_code = MHD_HTTP_NOT_ACCEPTABLE;        break; /* 4.05 Method Not Allowed */
-                case COAP_RESPONSE_415:         http_code = MHD_HTTP_UNSUPPORTED_MEDIA_TYPE;break; /* 4.15 Unsupported Media Type */
-                case COAP_RESPONSE_500:         http_code = MHD_HTTP_INTERNAL_SERVER_ERROR; break; /* 5.00 Internal Server Error */
-                case COAP_RESPONSE_501:         http_code = MHD_HTTP_NOT_IMPLEMENTED;       break; /* 5.01 Not Implemented */
-                case COAP_RESPONSE_503:         http_code = MHD_HTTP_SERVICE_UNAVAILABLE;   break; /* 5.03 Service Unavailable */
-                case COAP_RESPONSE_504:         http_code = MHD_HTTP_GATEWAY_TIMEOUT;       break; /* 5.04 Gateway Timeout */
-                default:                        http_code = MHD_HTTP_INTERNAL_SERVER_ERROR; break;
+                case COAP_RESPONSE_200:         http_code = HTTP_NO_CONTENT;            break; /* 2.00 OK */
+                case COAP_RESPONSE_201:         http_code = HTTP_CREATED;               break; /* 2.01 Created */
+                case COAP_RESPONSE_CODE(205):   http_code = HTTP_OK;                    break;
+                case COAP_RESPONSE_304:         http_code = HTTP_ACCEPTED;              break; /* 2.03 Valid */
+                case COAP_RESPONSE_400:         http_code = HTTP_BAD_REQUEST;           break; /* 4.00 Bad Request */
+                case COAP_RESPONSE_404:         http_code = HTTP_NOT_FOUND;             break; /* 4.04 Not Found */
+                case COAP_RESPONSE_405:         http_code = HTTP_NOT_ACCEPTABLE;        break; /* 4.05 Method Not Allowed */
+                case COAP_RESPONSE_415:         http_code = HTTP_UNSUPPORTED_MEDIA_TYPE;break; /* 4.15 Unsupported Media Type */
+                case COAP_RESPONSE_500:         http_code = HTTP_INTERNAL_SERVER_ERROR; break; /* 5.00 Internal Server Error */
+                case COAP_RESPONSE_501:         http_code = HTTP_NOT_IMPLEMENTED;       break; /* 5.01 Not Implemented */
+                case COAP_RESPONSE_503:         http_code = HTTP_SERVICE_UNAVAILABLE;   break; /* 5.03 Service Unavailable */
+                case COAP_RESPONSE_504:         http_code = HTTP_GATEWAY_TIMEOUT;       break; /* 5.04 Gateway Timeout */
+                default:                        http_code = HTTP_INTERNAL_SERVER_ERROR; break;
             }
 
-            // Send the response
-            MHD_queue_response(connection, http_code, response);
-            MHD_destroy_response(response);
-
-            const struct sockaddr_in *client_addr = (const struct sockaddr_in *)
-                    MHD_get_connection_info(connection, MHD_CONNECTION_INFO_CLIENT_ADDRESS)->client_addr;
-            printf("HTTP %13s:%-5u <- %u %s [ %s, %zu bytes, \"%s\" ]\n", inet_ntoa(client_addr->sin_addr),
-                   ntohs(client_addr->sin_port), http_code, http_reason_phrase_for(http_code),
-                   http_content_type, len, (databuf != NULL) ? (char *)databuf : "");
+            // Hand the response to the caller, this also clears the association
+            exchange_complete(exchange, http_code);
+            return;
         }
-
-        // clear the association
-        http_coap_pairs[i].connection = NULL;
-        return;
     }
 }
\ No newline at end of file
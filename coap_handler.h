@@ -2,8 +2,10 @@
 #define HTTP2COAP_COAP_HANDLER_H
 
 #include <coap/coap.h>
+#include "http2coap.h"
 
-void coap_response_handler(struct coap_context_t *ctx, const coap_endpoint_t *local_interface,
-                           const coap_address_t *remote, coap_pdu_t *sent, coap_pdu_t *received, const coap_tid_t id);
+// Called by the CoAP thread for every response it receives on the socket of the context
+void coap_response_handler(http2coap_context_t *context, const coap_address_t *remote, coap_pdu_t *sent,
+                           coap_pdu_t *received, const coap_tid_t id);
 
 #endif //HTTP2COAP_COAP_HANDLER_H
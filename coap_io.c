@@ -0,0 +1,168 @@
+// recvmmsg() and sendmmsg() are Linux specific
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "coap_io.h"
+
+static const char *batch_bucket_names[COAP_IO_BATCH_BUCKETS] = { "1", "2-3", "4-7", "8-15", "16-31", "32" };
+
+// The network_send hook of libcoap gets no user pointer, each CoAP thread sends through its own batch
+static __thread coap_io_t *thread_io = NULL;
+
+void coap_io_init(coap_io_t *io) {
+    memset(io, 0, sizeof(coap_io_t));
+    pthread_mutex_init(&io->stats_lock, NULL);
+}
+
+void coap_io_destroy(coap_io_t *io) {
+    pthread_mutex_destroy(&io->stats_lock);
+}
+
+static void count_batch(coap_io_t *io, coap_io_stats_t *stats, unsigned int datagrams) {
+    unsigned int bucket = 0;
+    while(bucket < COAP_IO_BATCH_BUCKETS - 1 && (datagrams >> (bucket + 1)) != 0)
+        bucket++;
+
+    pthread_mutex_lock(&io->stats_lock);
+    stats->syscalls++;
+    stats->datagrams += datagrams;
+    if(datagrams > stats->max_batch)
+        stats->max_batch = datagrams;
+    stats->batches[bucket]++;
+    pthread_mutex_unlock(&io->stats_lock);
+}
+
+// Replaces coap_network_send(): the datagram leaves with the next coap_io_flush()
+static ssize_t queue_datagram(struct coap_context_t *context, const coap_endpoint_t *local_interface,
+                              const coap_address_t *dst, unsigned char *data, size_t datalen) {
+    coap_io_t *io = thread_io;
+    if(datalen > COAP_MAX_PDU_SIZE || io == NULL)
+        return -1;
+    if(io->pending_count == COAP_IO_BATCH)
+        coap_io_flush(io, context);
+
+    coap_io_datagram_t *datagram = &io->pending[io->pending_count++];
+    datagram->destination = *dst;
+    datagram->length = datalen;
+    memcpy(datagram->data, data, datalen);
+    return (ssize_t)datalen;
+}
+
+void coap_io_attach(coap_io_t *io, coap_context_t *ctx) {
+    thread_io = io;
+    ctx->network_send = queue_datagram;
+}
+
+void coap_io_flush(coap_io_t *io, coap_context_t *ctx) {
+    struct mmsghdr messages[COAP_IO_BATCH];
+    struct iovec iov[COAP_IO_BATCH];
+    coap_io_datagram_t *pending = io->pending;
+    unsigned int pending_count = io->pending_count;
+
+    if(pending_count == 0)
+        return;
+
+    memset(messages, 0, pending_count * sizeof(struct mmsghdr));
+    for(unsigned int i = 0; i < pending_count; i++) {
+        iov[i].iov_base = pending[i].data;
+        iov[i].iov_len = pending[i].length;
+        messages[i].msg_hdr.msg_name = &pending[i].destination.addr;
+        messages[i].msg_hdr.msg_namelen = pending[i].destination.size;
+        messages[i].msg_hdr.msg_iov = &iov[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    unsigned int sent = 0;
+    while(sent < pending_count) {
+        int result = sendmmsg(ctx->sockfd, messages + sent, pending_count - sent, 0);
+        if(result < 0) {
+            if(errno == EINTR)
+                continue;
+            // What is left is lost like any datagram would be, confirmable requests are retransmitted
+            perror("sendmmsg");
+            break;
+        }
+        count_batch(io, &io->send_stats, (unsigned int)result);
+        sent += (unsigned int)result;
+    }
+    io->pending_count = 0;
+}
+
+int coap_io_receive(coap_io_t *io, int sockfd, coap_pdu_t **pdus, coap_address_t *sources, size_t *lengths, unsigned int count) {
+    struct mmsghdr messages[COAP_IO_BATCH];
+    struct iovec iov[COAP_IO_BATCH];
+
+    if(count > COAP_IO_BATCH)
+        count = COAP_IO_BATCH;
+
+    memset(messages, 0, count * sizeof(struct mmsghdr));
+    for(unsigned int i = 0; i < count; i++) {
+        coap_address_init(&sources[i]);
+        iov[i].iov_base = pdus[i]->hdr;
+        iov[i].iov_len = pdus[i]->max_size;
+        messages[i].msg_hdr.msg_name = &sources[i].addr;
+        messages[i].msg_hdr.msg_namelen = sizeof(sources[i].addr);
+        messages[i].msg_hdr.msg_iov = &iov[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int result;
+    do {
+        result = recvmmsg(sockfd, messages, count, MSG_DONTWAIT, NULL);
+    } while(result < 0 && errno == EINTR);
+    if(result < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+
+    for(int i = 0; i < result; i++) {
+        sources[i].size = messages[i].msg_hdr.msg_namelen;
+        // A truncated datagram is rejected by the parser
+        lengths[i] = (messages[i].msg_hdr.msg_flags & MSG_TRUNC) ? 0 : messages[i].msg_len;
+    }
+    if(result > 0)
+        count_batch(io, &io->receive_stats, (unsigned int)result);
+    return result;
+}
+
+size_t coap_io_format_stats(coap_io_t *io, char *buf, size_t size) {
+    size_t length = 0;
+    int written = snprintf(buf, size, "direction\tsyscalls\tdatagrams\tavg_batch\tmax_batch");
+    if(written < 0 || (size_t)written >= size)
+        return 0;
+    length = (size_t)written;
+    for(int i = 0; i < COAP_IO_BATCH_BUCKETS && length < size; i++) {
+        written = snprintf(buf + length, size - length, "\tbatches_%s", batch_bucket_names[i]);
+        if(written < 0 || (size_t)written >= size - length)
+            return length;
+        length += (size_t)written;
+    }
+
+    pthread_mutex_lock(&io->stats_lock);
+    const coap_io_stats_t *stats[] = { &io->receive_stats, &io->send_stats };
+    const char *directions[] = { "receive", "send" };
+    for(int i = 0; i < 2; i++) {
+        written = snprintf(buf + length, size - length, "\n%s\t%lu\t%lu\t%.2f\t%u", directions[i],
+                           stats[i]->syscalls, stats[i]->datagrams,
+                           stats[i]->syscalls ? (double)stats[i]->datagrams / stats[i]->syscalls : 0.0,
+                           stats[i]->max_batch);
+        if(written < 0 || (size_t)written >= size - length)
+            break;
+        length += (size_t)written;
+        for(int j = 0; j < COAP_IO_BATCH_BUCKETS; j++) {
+            written = snprintf(buf + length, size - length, "\t%lu", stats[i]->batches[j]);
+            if(written < 0 || (size_t)written >= size - length)
+                break;
+            length += (size_t)written;
+        }
+    }
+    pthread_mutex_unlock(&io->stats_lock);
+
+    if(length + 1 < size) {
+        buf[length++] = '\n';
+        buf[length] = '\0';
+    }
+    return length;
+}
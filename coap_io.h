@@ -0,0 +1,56 @@
+#ifndef HTTP2COAP_COAP_IO_H
+#define HTTP2COAP_COAP_IO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <coap/coap.h>
+
+#include <pthread.h>
+
+// Most datagrams moved by a single recvmmsg() or sendmmsg()
+#define COAP_IO_BATCH 32
+
+// Batches are counted per power of two: 1, 2-3, 4-7, 8-15, 16-31, 32
+#define COAP_IO_BATCH_BUCKETS 6
+
+typedef struct {
+    unsigned long syscalls;
+    unsigned long datagrams;
+    unsigned int max_batch;
+    unsigned long batches[COAP_IO_BATCH_BUCKETS];
+} coap_io_stats_t;
+
+// Datagrams libcoap asked us to send during the current iteration of the CoAP loop. libcoap frees some
+// PDUs (ACKs, failed sends) right after sending them, so the bytes are copied.
+typedef struct {
+    coap_address_t destination;
+    size_t length;
+    unsigned char data[COAP_MAX_PDU_SIZE];
+} coap_io_datagram_t;
+
+// Batched I/O of one CoAP socket
+typedef struct {
+    coap_io_datagram_t pending[COAP_IO_BATCH];
+    unsigned int pending_count;
+
+    pthread_mutex_t stats_lock;
+    coap_io_stats_t receive_stats, send_stats;
+} coap_io_t;
+
+void coap_io_init(coap_io_t *io);
+void coap_io_destroy(coap_io_t *io);
+
+// Route everything libcoap sends on the context through the send batch of io, called by the CoAP thread
+// before it sends anything
+void coap_io_attach(coap_io_t *io, coap_context_t *ctx);
+// Send what was queued since the last flush in as few syscalls as possible, called from the CoAP thread
+void coap_io_flush(coap_io_t *io, coap_context_t *ctx);
+
+// Receive up to count datagrams straight into the given PDUs, returns how many were received (0 when none
+// is ready) or -1 on error. lengths[i] is the size of the i-th datagram, sources[i] where it came from.
+int coap_io_receive(coap_io_t *io, int sockfd, coap_pdu_t **pdus, coap_address_t *sources, size_t *lengths, unsigned int count);
+
+// Writes syscall and batch size statistics as text, returns the length written
+size_t coap_io_format_stats(coap_io_t *io, char *buf, size_t size);
+
+#endif //HTTP2COAP_COAP_IO_H
@@ -45,11 +45,7 @@ coap_delete_list(coap_list_t *queue) {
     }
 }
 
-coap_list_t *new_option_node(unsigned short key, unsigned int length, unsigned char *data) {
-    coap_list_t *node;
-
-    node = coap_malloc(sizeof(coap_list_t) + sizeof(coap_option) + length);
-
+static coap_list_t *init_option_node(coap_list_t *node, unsigned short key, unsigned int length, unsigned char *data) {
     if (node) {
         coap_option *option;
         option = (coap_option *)(node->data);
@@ -61,4 +57,12 @@ coap_list_t *new_option_node(unsigned short key, unsigned int length, unsigned c
     }
 
     return node;
+}
+
+coap_list_t *new_option_node(unsigned short key, unsigned int length, unsigned char *data) {
+    return init_option_node(coap_malloc(sizeof(coap_list_t) + sizeof(coap_option) + length), key, length, data);
+}
+
+coap_list_t *new_option_node_from(arena_t *arena, unsigned short key, unsigned int length, unsigned char *data) {
+    return init_option_node(arena_alloc(arena, sizeof(coap_list_t) + sizeof(coap_option) + length), key, length, data);
 }
\ No newline at end of file
@@ -12,6 +12,7 @@
 #define _COAP_LIST_H_
 
 #include <coap/coap.h>
+#include "arena.h"
 
 typedef struct coap_list_t {
     struct coap_list_t *next;
@@ -33,4 +34,7 @@ void coap_delete_list(coap_list_t *queue);
 
 coap_list_t *new_option_node(unsigned short key, unsigned int length, unsigned char *data);
 
+/* same as new_option_node(), but the node is released along with the arena */
+coap_list_t *new_option_node_from(arena_t *arena, unsigned short key, unsigned int length, unsigned char *data);
+
 #endif /* _COAP_LIST_H_ */
\ No newline at end of file
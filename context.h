@@ -0,0 +1,50 @@
+#ifndef HTTP2COAP_CONTEXT_H
+#define HTTP2COAP_CONTEXT_H
+
+#include <pthread.h>
+#include <netinet/in.h>
+#include <coap/coap.h>
+#include "http2coap.h"
+#include "exchange.h"
+#include "scheduler.h"
+#include "multicast.h"
+#include "resource_directory.h"
+#include "coap_io.h"
+#include "hedge.h"
+
+// A request on the wire, until its response arrives. A hedged exchange holds two of them.
+typedef struct {
+    unsigned short message_id;
+    exchange_t *exchange;
+    int hedge;                          // the duplicate sent to a replica
+    coap_tick_t sent_at;
+} in_flight_t;
+
+// Room for every exchange the upstream may have in flight, and for a hedge of each
+#define IN_FLIGHT_SLOTS (2 * HTTP2COAP_MAX_IN_FLIGHT)
+
+// Everything one proxy instance needs, the modules of the core only reach their state through it
+struct http2coap_context_t {
+    http2coap_config_t config;
+
+    coap_context_t *coap_context;       // owned by the CoAP thread once it runs
+    struct sockaddr_in destination;
+    struct sockaddr_in replicas[HTTP2COAP_MAX_REPLICAS];
+    unsigned int replica_count;
+    unsigned int next_replica;
+    in_flight_t in_flight[IN_FLIGHT_SLOTS];
+    coap_pdu_t *receive_pdus[COAP_IO_BATCH];    // CoAP thread only, kept from one read to the next
+
+    pthread_t coap_thread;
+    volatile int coap_thread_running;
+    int wakeup_pipe[2];
+    coap_tick_t last_client_check;
+
+    scheduler_t scheduler;
+    multicast_t multicast;
+    resource_directory_t resource_directory;
+    coap_io_t io;
+    hedge_t hedge;
+};
+
+#endif //HTTP2COAP_CONTEXT_H
@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include "exchange.h"
+#include "context.h"
+#include "pool.h"
+#include "coap_client.h"
+#include "scheduler.h"
+#include "multicast.h"
+#include "http_status.h"
+
+static pool_t exchange_pool = POOL_INITIALIZER(sizeof(exchange_t), HTTP2COAP_MAX_IN_FLIGHT);
+// Serializes the hand-over of an exchange between the CoAP thread and the caller
+static pthread_mutex_t exchange_lock = PTHREAD_MUTEX_INITIALIZER;
+
+exchange_t *exchange_new(http2coap_context_t *context) {
+    exchange_t *exchange = pool_get(&exchange_pool);
+    if(exchange == NULL) {
+        perror("exchange_new");
+        return NULL;
+    }
+    memset(exchange, 0, offsetof(exchange_t, arena));
+    arena_init(&exchange->arena);
+    exchange->context = context;
+    exchange->state = EXCHANGE_NEW;
+    exchange->client_fd = -1;
+    exchange->priority = PRIORITY_NORMAL;
+    exchange->tid = COAP_INVALID_TID;
+    exchange->hedge_tid = COAP_INVALID_TID;
+    exchange->response.headers = exchange->headers;
+    return exchange;
+}
+
+void exchange_free(exchange_t *exchange) {
+    if(exchange == NULL)
+        return;
+    if(exchange->received)
+        received_pdu_release(exchange->received);
+    // Whoever frees the exchange is the last one to touch it, the timeline is complete
+    if(exchange->trace)
+        trace_finish(exchange->trace, exchange->response.status);
+    // The options list lives in the arena
+    arena_release(&exchange->arena);
+    pool_put(&exchange_pool, exchange);
+}
+
+void exchange_pool_preallocate(unsigned int count) {
+    pool_preallocate(&exchange_pool, count);
+}
+
+void exchange_add_header(exchange_t *exchange, const char *name, const char *value) {
+    if(exchange->response.header_count == EXCHANGE_MAX_HEADERS)
+        return;
+    size_t length = strlen(value) + 1;
+    char *copy = arena_alloc(&exchange->arena, length);
+    if(copy == NULL)
+        return;
+    exchange->headers[exchange->response.header_count].name = name;
+    exchange->headers[exchange->response.header_count].value = memcpy(copy, value, length);
+    exchange->response.header_count++;
+}
+
+// Stop everything the CoAP thread does for the exchange
+static void exchange_release_upstream(exchange_t *exchange) {
+    http2coap_context_t *context = exchange->context;
+
+    // Free the upstream slot so the scheduler can admit the next exchange, and the one of the hedge if any
+    for(int i = 0; i < IN_FLIGHT_SLOTS; i++) {
+        if(context->in_flight[i].exchange == exchange)
+            context->in_flight[i].exchange = NULL;
+    }
+
+    // No more retransmissions, a late response would find no exchange anyway.
+    // This is also how the losing side of a hedged exchange is cancelled.
+    coap_tid_t *tids[] = { &exchange->tid, &exchange->hedge_tid };
+    for(int i = 0; i < 2; i++) {
+        if(*tids[i] != COAP_INVALID_TID) {
+            coap_queue_t *node = NULL;
+            if(coap_remove_from_queue(&context->coap_context->sendqueue, *tids[i], &node))
+                coap_delete_node(node);
+            *tids[i] = COAP_INVALID_TID;
+        }
+    }
+}
+
+// Must be called with exchange_lock held, so that the caller cannot release the exchange meanwhile
+static void notify(exchange_t *exchange, http2coap_event_t event) {
+    exchange->callback(exchange, event, event == HTTP2COAP_RESPONSE ? &exchange->response : NULL,
+                       exchange->callback_arg);
+}
+
+void exchange_complete(exchange_t *exchange, unsigned int status) {
+    exchange_release_upstream(exchange);
+
+    // Nobody waits for the exchanges of the proxy itself
+    if(exchange->callback == NULL) {
+        if(exchange->coap_handler)
+            exchange->coap_handler(exchange, NULL);
+        exchange_free(exchange);
+        return;
+    }
+
+    exchange->response.status = status;
+    if(exchange->trace)
+        exchange_add_header(exchange, TRACE_HEADER, exchange->trace->id);
+
+    pthread_mutex_lock(&exchange_lock);
+    if(exchange->abandoned) {
+        pthread_mutex_unlock(&exchange_lock);
+        exchange_free(exchange);
+        return;
+    }
+    exchange->state = EXCHANGE_DONE;
+    notify(exchange, HTTP2COAP_RESPONSE);
+    pthread_mutex_unlock(&exchange_lock);
+}
+
+void exchange_cancel(exchange_t *exchange) {
+    scheduler_cancel(exchange);
+    exchange_release_upstream(exchange);
+
+    pthread_mutex_lock(&exchange_lock);
+    if(exchange->abandoned || exchange->callback == NULL) {
+        pthread_mutex_unlock(&exchange_lock);
+        if(exchange->callback == NULL && exchange->coap_handler)
+            exchange->coap_handler(exchange, NULL);
+        exchange_free(exchange);
+        return;
+    }
+    exchange->state = EXCHANGE_CANCELLED;
+    notify(exchange, HTTP2COAP_CANCELLED);
+    pthread_mutex_unlock(&exchange_lock);
+}
+
+int exchange_abandon(exchange_t *exchange) {
+    pthread_mutex_lock(&exchange_lock);
+    if(exchange->state == EXCHANGE_STREAMING) {
+        pthread_mutex_unlock(&exchange_lock);
+        // The fan-out state decides who frees the exchange
+        multicast_release(exchange);
+        return 0;
+    }
+    int owned_by_coap_thread = exchange->state == EXCHANGE_QUEUED || exchange->state == EXCHANGE_IN_FLIGHT;
+    if(owned_by_coap_thread)
+        exchange->abandoned = 1;
+    pthread_mutex_unlock(&exchange_lock);
+
+    if(owned_by_coap_thread)
+        coap_client_wakeup(exchange->context);
+    return !owned_by_coap_thread;
+}
+
+int exchange_stream(exchange_t *exchange, unsigned int status) {
+    exchange->response.status = status;
+    exchange->response.streamed = 1;
+    if(exchange->trace)
+        exchange_add_header(exchange, TRACE_HEADER, exchange->trace->id);
+
+    pthread_mutex_lock(&exchange_lock);
+    exchange->state = EXCHANGE_STREAMING;
+    int wanted = !exchange->abandoned;
+    if(wanted)
+        notify(exchange, HTTP2COAP_RESPONSE);
+    pthread_mutex_unlock(&exchange_lock);
+    return wanted;
+}
+
+// The message is the body of the response, it must be a string literal
+void exchange_fail(exchange_t *exchange, unsigned int status, const char *message) {
+    fputs(message, stderr);
+    exchange->response.body = (const unsigned char *)message;
+    exchange->response.body_length = strlen(message);
+    exchange_add_header(exchange, HTTP_HEADER_CONTENT_TYPE, "text/plain");
+    exchange_complete(exchange, status);
+}
@@ -0,0 +1,93 @@
+#ifndef HTTP2COAP_EXCHANGE_H
+#define HTTP2COAP_EXCHANGE_H
+
+#include <stdint.h>
+#include <coap/coap.h>
+#include "http2coap.h"
+#include "coap_client.h"
+#include "coap_list.h"
+#include "arena.h"
+#include "trace.h"
+
+typedef enum {
+    PRIORITY_HIGH,
+    PRIORITY_NORMAL,
+    PRIORITY_BULK,
+    PRIORITY_CLASSES
+} priority_class_t;
+
+typedef enum {
+    EXCHANGE_NEW,       // being described by the caller
+    EXCHANGE_QUEUED,    // waiting in the scheduler for an upstream slot
+    EXCHANGE_IN_FLIGHT, // CoAP request sent, waiting for the response
+    EXCHANGE_STREAMING, // response handed over, the CoAP thread still produces its body
+    EXCHANGE_DONE,      // response handed over
+    EXCHANGE_CANCELLED  // the client went away, the caller was told so
+} exchange_state_t;
+
+#define EXCHANGE_MAX_HEADERS 8
+
+struct multicast_route_t;
+struct multicast_state_t;
+
+// One HTTP request and the CoAP exchange it is translated to
+typedef struct exchange_t {
+    struct exchange_t *next;            // link in the scheduler queue of its priority class
+    http2coap_context_t *context;
+    exchange_state_t state;
+    int abandoned;                      // the caller released us while the CoAP thread owned us
+
+    // Where the response goes, there is no callback for exchanges of the proxy itself
+    http2coap_callback_t callback;
+    void *callback_arg;
+    int client_fd;                      // watched while the exchange waits, -1 if none
+
+    const char *url;                    // as requested over HTTP, NULL for exchanges of the proxy itself
+    method_t method;
+    coap_list_t *options;
+    unsigned char *payload;
+    size_t payload_length;
+    // For exchanges of the proxy itself: consumes the response, or NULL when the exchange failed
+    void (*coap_handler)(struct exchange_t *exchange, coap_pdu_t *received);
+    const struct multicast_route_t *multicast_route;   // set for fan-out requests
+    struct multicast_state_t *multicast;
+
+    priority_class_t priority;
+    uint64_t finish_tag;                // virtual finish time used for weighted fair queueing
+    coap_tick_t enqueued_at;
+    coap_tick_t queue_delay;
+    coap_tick_t deadline;               // bounds both queueing and retransmissions
+    coap_tid_t tid;                     // of the confirmable request while it may be retransmitted
+    coap_tid_t hedge_tid;               // same for the duplicate sent to a replica
+    int hedged;                         // a replica was asked too, or it was decided not to
+
+    http2coap_response_t response;
+    http2coap_header_t headers[EXCHANGE_MAX_HEADERS];
+    coap_pdu_t *received;               // the response body points into it
+
+    trace_t *trace;                     // set for sampled exchanges only
+
+    arena_t arena;                      // transient allocations of this exchange (options, buffers)
+} exchange_t;
+
+// Exchange records are recycled through a pool, their arena is released in one step by exchange_free()
+exchange_t *exchange_new(http2coap_context_t *context);
+void exchange_free(exchange_t *exchange);
+void exchange_pool_preallocate(unsigned int count);
+
+// The value is copied into the arena, the name must be a string literal
+void exchange_add_header(exchange_t *exchange, const char *name, const char *value);
+
+// Hand the response over to the caller, called from the CoAP thread only
+void exchange_complete(exchange_t *exchange, unsigned int status);
+void exchange_fail(exchange_t *exchange, unsigned int status, const char *message);
+// The client is gone: stop the CoAP side of the exchange and tell the caller
+void exchange_cancel(exchange_t *exchange);
+// The caller is done with the exchange, returns 1 if it can be freed now, otherwise the CoAP thread frees it
+// as soon as it notices
+int exchange_abandon(exchange_t *exchange);
+// Same as exchange_complete() for a response whose body is still being produced by the CoAP thread,
+// returns 0 when the caller has already let go of the exchange
+int exchange_stream(exchange_t *exchange, unsigned int status);
+
+#endif //HTTP2COAP_EXCHANGE_H
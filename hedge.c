@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hedge.h"
+
+void hedge_init(hedge_t *hedge) {
+    memset(hedge, 0, sizeof(hedge_t));
+    pthread_mutex_init(&hedge->stats_lock, NULL);
+}
+
+void hedge_destroy(hedge_t *hedge) {
+    pthread_mutex_destroy(&hedge->stats_lock);
+}
+
+static int compare_ticks(const void *a, const void *b) {
+    coap_tick_t x = *(const coap_tick_t *)a, y = *(const coap_tick_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+void hedge_record_rtt(hedge_t *hedge, coap_tick_t rtt, unsigned int percentile) {
+    if(percentile == 0)
+        return;
+    hedge->rtt[hedge->rtt_next] = rtt;
+    hedge->rtt_next = (hedge->rtt_next + 1) % HEDGE_RTT_SAMPLES;
+    if(hedge->rtt_count < HEDGE_RTT_SAMPLES)
+        hedge->rtt_count++;
+    if(hedge->rtt_count < HEDGE_MIN_SAMPLES)
+        return;
+
+    // A few dozen samples, sorting a copy on every response is cheaper than keeping a histogram
+    coap_tick_t sorted[HEDGE_RTT_SAMPLES];
+    memcpy(sorted, hedge->rtt, hedge->rtt_count * sizeof(coap_tick_t));
+    qsort(sorted, hedge->rtt_count, sizeof(coap_tick_t), compare_ticks);
+    coap_tick_t delay = sorted[(hedge->rtt_count - 1) * percentile / 100];
+
+    pthread_mutex_lock(&hedge->stats_lock);
+    // Never 0, which means "not enough samples yet"
+    hedge->delay = delay ? delay : 1;
+    pthread_mutex_unlock(&hedge->stats_lock);
+}
+
+void hedge_count_request(hedge_t *hedge, unsigned int max_percent) {
+    hedge->credit += max_percent;
+    if(hedge->credit > HEDGE_BURST * 100)
+        hedge->credit = HEDGE_BURST * 100;
+
+    pthread_mutex_lock(&hedge->stats_lock);
+    hedge->requests++;
+    pthread_mutex_unlock(&hedge->stats_lock);
+}
+
+int hedge_take(hedge_t *hedge) {
+    int allowed = hedge->credit >= 100;
+    if(allowed)
+        hedge->credit -= 100;
+
+    pthread_mutex_lock(&hedge->stats_lock);
+    if(allowed)
+        hedge->hedges++;
+    else
+        hedge->capped++;
+    pthread_mutex_unlock(&hedge->stats_lock);
+    return allowed;
+}
+
+void hedge_count_win(hedge_t *hedge, int from_replica) {
+    pthread_mutex_lock(&hedge->stats_lock);
+    if(from_replica)
+        hedge->hedge_wins++;
+    else
+        hedge->primary_wins++;
+    pthread_mutex_unlock(&hedge->stats_lock);
+}
+
+size_t hedge_format_stats(hedge_t *hedge, char *buf, size_t size) {
+    pthread_mutex_lock(&hedge->stats_lock);
+    int written = snprintf(buf, size, "delay_ms\trequests\thedges\tcapped\thedge_wins\tprimary_wins\n"
+                                      "%lu\t%lu\t%lu\t%lu\t%lu\t%lu\n",
+                           (unsigned long)(hedge->delay * 1000 / COAP_TICKS_PER_SECOND), hedge->requests,
+                           hedge->hedges, hedge->capped, hedge->hedge_wins, hedge->primary_wins);
+    pthread_mutex_unlock(&hedge->stats_lock);
+    if(written < 0)
+        return 0;
+    return (size_t)written < size ? (size_t)written : size - 1;
+}
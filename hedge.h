@@ -0,0 +1,48 @@
+#ifndef HTTP2COAP_HEDGE_H
+#define HTTP2COAP_HEDGE_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <coap/coap.h>
+
+// Response times kept to compute the hedging delay, and how many are needed before hedging starts
+#define HEDGE_RTT_SAMPLES 64
+#define HEDGE_MIN_SAMPLES 16
+// Hedges that may be sent in a row after a quiet period, whatever the cap
+#define HEDGE_BURST 4
+
+// When a GET is duplicated to a replica: once it has waited longer than a percentile of the recent response
+// times, and only as long as hedges stay under a share of the requests sent
+typedef struct {
+    coap_tick_t rtt[HEDGE_RTT_SAMPLES];
+    unsigned int rtt_count;
+    unsigned int rtt_next;
+    coap_tick_t delay;                  // 0 until enough response times are known
+    unsigned int credit;                // in hundredths of a hedge
+
+    pthread_mutex_t stats_lock;
+    unsigned long requests;
+    unsigned long hedges;
+    unsigned long hedge_wins;
+    unsigned long primary_wins;
+    unsigned long capped;
+} hedge_t;
+
+void hedge_init(hedge_t *hedge);
+void hedge_destroy(hedge_t *hedge);
+
+// The following are only called from the CoAP thread
+
+// A response arrived rtt ticks after the request it answers was sent
+void hedge_record_rtt(hedge_t *hedge, coap_tick_t rtt, unsigned int percentile);
+// A request went to the primary upstream, each one earns max_percent hundredths of a hedge
+void hedge_count_request(hedge_t *hedge, unsigned int max_percent);
+// Returns 1 when a hedge may be sent now, and accounts for it
+int hedge_take(hedge_t *hedge);
+// The first response of a hedged exchange came from the replica or from the primary
+void hedge_count_win(hedge_t *hedge, int from_replica);
+
+// Writes the hedging delay and counters as text, returns the length written
+size_t hedge_format_stats(hedge_t *hedge, char *buf, size_t size);
+
+#endif //HTTP2COAP_HEDGE_H
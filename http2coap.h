@@ -0,0 +1,123 @@
+#ifndef HTTP2COAP_H
+#define HTTP2COAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// libhttp2coap: the proxy core, for programs that have an HTTP stack of their own.
+// Each context owns its upstream, its CoAP socket and the thread that serves them, contexts do not share
+// anything but the trace file, so several of them can live in the same process.
+
+typedef struct http2coap_context_t http2coap_context_t;
+typedef struct exchange_t http2coap_request_t;
+
+// Most exchanges a context keeps outstanding on its upstream
+#define HTTP2COAP_MAX_IN_FLIGHT 64
+// Most replicas of the upstream that hedged requests can go to
+#define HTTP2COAP_MAX_REPLICAS 4
+// Longest timeout or collection window, a day: deadlines have to fit in the 32 bit ticks of libcoap
+#define HTTP2COAP_MAX_TIMEOUT_MS (24u * 3600 * 1000)
+
+// Request headers the proxy looks at
+#define HTTP2COAP_PRIORITY_HEADER "X-Priority"          // high, normal or bulk
+#define HTTP2COAP_TIMEOUT_HEADER "X-Request-Timeout"    // seconds, capped by request_timeout_max_ms
+
+typedef struct {
+    const char *coap_host;
+    uint16_t coap_port;
+    unsigned int max_in_flight;                         // NSTART, RFC 7252 section 4.7
+    unsigned int request_timeout_max_ms;                // bounds queueing and retransmissions
+    unsigned int multicast_window_ms;                   // how long fan-out responses are collected
+    unsigned int resource_directory_refresh_seconds;    // 0 disables the directory and fast 404s
+    unsigned int negative_cache_ttl_seconds;            // 0 disables negative caching
+    unsigned int hedge_percentile;                      // GETs still unanswered after this percentile of the
+                                                        // recent response times go to a replica too, 0 disables
+    unsigned int hedge_max_percent;                     // cap of the hedges, as a share of the requests sent
+} http2coap_config_t;
+
+typedef struct {
+    const char *name;
+    const char *value;
+} http2coap_header_t;
+
+typedef struct {
+    const char *method;
+    const char *path;                   // without the query string
+    const http2coap_header_t *headers;
+    size_t header_count;
+    const void *body;                   // sent as the CoAP payload
+    size_t body_length;
+    int client_fd;                      // the request is cancelled when this socket is closed, or -1
+} http2coap_request_info_t;
+
+typedef struct {
+    unsigned int status;
+    const http2coap_header_t *headers;  // Content-Type included
+    size_t header_count;
+    const unsigned char *body;          // points into the received datagram, valid until the request is released
+    size_t body_length;
+    int streamed;                       // the body is produced later, read it with http2coap_read_body()
+} http2coap_response_t;
+
+typedef enum {
+    HTTP2COAP_RESPONSE,                 // the response is ready
+    HTTP2COAP_CANCELLED,                // the client went away, there is nothing to send
+    HTTP2COAP_BODY_WAIT,                // nothing more to read from a streamed body until HTTP2COAP_BODY_READY
+    HTTP2COAP_BODY_READY                // more of a streamed body can be read
+} http2coap_event_t;
+
+// Called from the thread of the context (HTTP2COAP_BODY_WAIT from within http2coap_read_body()), response
+// is only set for HTTP2COAP_RESPONSE. It must not release the request.
+typedef void (*http2coap_callback_t)(http2coap_request_t *request, http2coap_event_t event,
+                                     const http2coap_response_t *response, void *arg);
+
+// A context starts with the default configuration, which can be changed until it is started
+http2coap_context_t *http2coap_new(void);
+http2coap_config_t *http2coap_config(http2coap_context_t *context);
+// Weights of the high, normal and bulk priority classes, as "high,normal,bulk"
+int http2coap_set_weights(http2coap_context_t *context, const char *spec);
+// Priority rule "[METHOD:]/prefix=class", first matching rule wins
+int http2coap_add_priority_rule(http2coap_context_t *context, const char *spec);
+// Fan-out route "/prefix=group[%interface]" like ff02::fd%eth0 or 224.0.1.187%lo
+int http2coap_add_multicast_route(http2coap_context_t *context, const char *spec);
+// Replica of the upstream, reached on the same port, that hedged requests are sent to.
+// Each IPv4 address of host becomes a replica, as long as there is room for it, and so do the other addresses
+// of the upstream itself. The address requests are sent to first is never a replica.
+int http2coap_add_replica(http2coap_context_t *context, const char *host);
+// Resolves the upstream, opens the CoAP socket and starts the thread of the context
+int http2coap_start(http2coap_context_t *context);
+// Stops the thread and closes the socket. Requests still queued or in flight get HTTP2COAP_CANCELLED, fan-outs
+// end their body with the responses collected so far; the caller releases them as usual.
+void http2coap_stop(http2coap_context_t *context);
+void http2coap_free(http2coap_context_t *context);
+
+// uri labels the trace when the request is sampled, the request itself is described to prepare()
+http2coap_request_t *http2coap_request_new(http2coap_context_t *context, const char *uri);
+// Returns 0 when the request is to be sent upstream, otherwise the HTTP status to answer with right away
+unsigned int http2coap_request_prepare(http2coap_request_t *request, const http2coap_request_info_t *info);
+// Queues a prepared request, callback may run before this returns
+void http2coap_request_submit(http2coap_request_t *request, http2coap_callback_t callback, void *arg);
+// Reads from a streamed body, returns 0 when nothing is available yet and -1 at the end
+ssize_t http2coap_read_body(http2coap_request_t *request, char *buf, size_t max);
+// The caller is done with the request, after a response or to cancel it: no callback runs after this.
+// event (a string literal, or NULL) ends the timeline of a sampled request that the caller frees; a request
+// still queued or in flight belongs to the CoAP thread, which cancels it and ends its timeline itself.
+void http2coap_request_release(http2coap_request_t *request, const char *event);
+
+// Adds an event (a string literal) to the timeline of a sampled request
+void http2coap_request_trace(http2coap_request_t *request, const char *event);
+// NULL when the request is not sampled
+const char *http2coap_request_trace_id(const http2coap_request_t *request);
+// Sampled requests of every context are appended to path as Chrome trace events
+int http2coap_trace_open(const char *path, double sample_rate);
+void http2coap_trace_close(void);
+
+// Statistics as text, returns the length written
+size_t http2coap_scheduler_stats(http2coap_context_t *context, char *buf, size_t size);
+size_t http2coap_io_stats(http2coap_context_t *context, char *buf, size_t size);
+size_t http2coap_hedge_stats(http2coap_context_t *context, char *buf, size_t size);
+// Resource directory of the upstream as JSON in a malloc'd buffer, returns its length
+size_t http2coap_directory_json(http2coap_context_t *context, char **json);
+
+#endif //HTTP2COAP_H
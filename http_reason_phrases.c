@@ -84,10 +84,10 @@ static const char *const four_hundred[] = {
         "Unordered Collection",
         "Upgrade Required",
         "Unknown",
-        "Unknown",
-        "Unknown",
+        "Precondition Required",
+        "Too Many Requests",
         "Unknown", /* 430 */
-        "Unknown",
+        "Request Header Fields Too Large",
         "Unknown",
         "Unknown",
         "Unknown",
@@ -1,25 +1,76 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
 #include <arpa/inet.h>
-#include <coap/pdu.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include "http_server.h"
-#include "coap_client.h"
 #include "http_reason_phrases.h"
+#include "rate_limit.h"
+#include "pool.h"
 
 struct MHD_Daemon *http_daemon = NULL;
 char static_files_path[64] = {};
 static int http_request_handler(void *cls, struct MHD_Connection *connection, const char *url, const char *method,
                          const char *version, const char *upload_data, size_t *upload_data_size, void **con_cls);
-// These pairs are necessary to know to which connection we need to send the HTTP response when receiving a CoAP response
-http_coap_pair_t http_coap_pairs[MAX_HTTP_CONNECTIONS];
-// Where we need to send our CoAP requests
-struct sockaddr_in destination;
-
-void start_http_server(uint16_t port) {
-    http_daemon = MHD_start_daemon(MHD_USE_SELECT_INTERNALLY, port, NULL, NULL,
-                                   http_request_handler, NULL, MHD_OPTION_END);
-    memset(&http_coap_pairs, 0, sizeof(http_coap_pairs));
+static void http_request_completed(void *cls, struct MHD_Connection *connection, void **con_cls,
+                                   enum MHD_RequestTerminationCode toe);
+static void *http_request_started(void *cls, const char *uri, struct MHD_Connection *connection);
+
+// What we keep about an HTTP request while the proxy core works on it
+typedef struct {
+    struct MHD_Connection *connection;
+    http2coap_request_t *request;
+    const http2coap_response_t *response;   // set by the core, valid until the request is released
+    int accepted;                           // went through the checks of the first call
+    int submitted;
+    int cancelled;                          // the client went away while we were suspended
+    int body_too_large;
+    size_t body_length;
+    char body[MAX_REQUEST_BODY];
+} http_request_t;
+
+static pool_t http_request_pool = POOL_INITIALIZER(sizeof(http_request_t), MAX_HTTP_CONNECTIONS);
+
+void start_http_server(uint16_t port, http2coap_context_t *context) {
+    pool_preallocate(&http_request_pool, MAX_HTTP_CONNECTIONS);
+    http_daemon = MHD_start_daemon(MHD_USE_SELECT_INTERNALLY | MHD_USE_SUSPEND_RESUME, port, NULL, NULL,
+                                   http_request_handler, context,
+                                   MHD_OPTION_NOTIFY_COMPLETED, http_request_completed, NULL,
+                                   MHD_OPTION_URI_LOG_CALLBACK, http_request_started, context,
+                                   MHD_OPTION_END);
+}
+
+// Called by microhttpd as soon as the request line is in, so that the timeline of sampled requests starts
+// before the headers are parsed
+static void *http_request_started(void *cls, const char *uri, struct MHD_Connection *connection) {
+    http2coap_context_t *context = cls;
+    http_request_t *record = pool_get(&http_request_pool);
+    if(record == NULL)
+        return NULL;
+    memset(record, 0, offsetof(http_request_t, body));
+    record->connection = connection;
+    record->request = http2coap_request_new(context, uri);
+    if(record->request == NULL) {
+        pool_put(&http_request_pool, record);
+        return NULL;
+    }
+    return record;
+}
+
+// Called by microhttpd once the response has been sent (or the connection is gone): release the request
+static void http_request_completed(void *cls, struct MHD_Connection *connection, void **con_cls,
+                                   enum MHD_RequestTerminationCode toe) {
+    http_request_t *record = *con_cls;
+    if(record == NULL)
+        return;
+    // Requests that are queued or in flight are cancelled and freed by the CoAP thread
+    http2coap_request_release(record->request, toe == MHD_REQUEST_TERMINATED_COMPLETED_OK ? "last_byte"
+                                                                                           : "connection_closed");
+    pool_put(&http_request_pool, record);
+    *con_cls = NULL;
 }
 
 // Little wrapper for sending simple text responses
@@ -35,30 +86,222 @@ int send_simple_http_response(struct MHD_Connection *connection, unsigned int st
     return res;
 }
 
-// Ouptut an error to stderr and send en HTTP response too
-int coap_abort_to_http(struct MHD_Connection *connection, const char *message) {
-    fputs(message, stderr);
-    return send_simple_http_response(connection, MHD_HTTP_BAD_GATEWAY, message);
+// Text pages of counters, each written by one of the *_stats() functions of the core
+static int send_stats_page(struct MHD_Connection *connection, http2coap_context_t *context,
+                           size_t (*format_stats)(http2coap_context_t *context, char *buf, size_t size)) {
+    char stats[512];
+    size_t length = format_stats(context, stats, sizeof(stats));
+    struct MHD_Response *response = MHD_create_response_from_buffer(length, stats, MHD_RESPMEM_MUST_COPY);
+    MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, "text/plain");
+    int result = MHD_queue_response(connection, MHD_HTTP_OK, response);
+    MHD_destroy_response(response);
+    return result;
+}
+
+// Tell an over-limit client when it may come back
+static int send_rate_limited_http_response(struct MHD_Connection *connection, unsigned int retry_after) {
+    static const char message[] = "Rate limit exceeded";
+    char retry_after_str[12];
+    snprintf(retry_after_str, sizeof(retry_after_str), "%u", retry_after);
+
+    struct MHD_Response *response = MHD_create_response_from_buffer(strlen(message), (void *)message,
+                                                                    MHD_RESPMEM_PERSISTENT);
+    MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, "text/plain");
+    MHD_add_response_header(response, MHD_HTTP_HEADER_RETRY_AFTER, retry_after_str);
+    int res = MHD_queue_response(connection, MHD_HTTP_TOO_MANY_REQUESTS, response);
+    MHD_destroy_response(response);
+    const struct sockaddr_in *client_addr = (const struct sockaddr_in *)
+            MHD_get_connection_info(connection, MHD_CONNECTION_INFO_CLIENT_ADDRESS)->client_addr;
+    printf("HTTP %13s:%-5u <- %u %s [ retry after %us ]\n", inet_ntoa(client_addr->sin_addr),
+           ntohs(client_addr->sin_port), MHD_HTTP_TOO_MANY_REQUESTS,
+           http_reason_phrase_for(MHD_HTTP_TOO_MANY_REQUESTS), retry_after);
+    return res;
+}
+
+// Called by the core from the CoAP thread, or from http2coap_read_body() for HTTP2COAP_BODY_WAIT
+static void http_request_event(http2coap_request_t *request, http2coap_event_t event,
+                               const http2coap_response_t *response, void *arg) {
+    http_request_t *record = arg;
+    (void)request;
+
+    switch(event) {
+        case HTTP2COAP_RESPONSE:
+            record->response = response;
+            MHD_resume_connection(record->connection);
+            break;
+        case HTTP2COAP_CANCELLED:
+            record->cancelled = 1;
+            MHD_resume_connection(record->connection);
+            break;
+        case HTTP2COAP_BODY_WAIT:
+            MHD_suspend_connection(record->connection);
+            break;
+        case HTTP2COAP_BODY_READY:
+            MHD_resume_connection(record->connection);
+            break;
+    }
+}
+
+static ssize_t read_streamed_body(void *cls, uint64_t pos, char *buf, size_t max) {
+    http_request_t *record = cls;
+    (void)pos;
+    ssize_t length = http2coap_read_body(record->request, buf, max);
+    return length < 0 ? MHD_CONTENT_READER_END_OF_STREAM : length;
+}
+
+typedef struct {
+    http2coap_header_t headers[MAX_REQUEST_HEADERS];
+    size_t count;
+} header_list_t;
+
+// The headers the core acts on are looked up by name, so that they are never among those cut off at
+// MAX_REQUEST_HEADERS
+static const char *const core_headers[] = { HTTP2COAP_PRIORITY_HEADER, HTTP2COAP_TIMEOUT_HEADER };
+#define CORE_HEADERS (sizeof(core_headers) / sizeof(core_headers[0]))
+
+static int collect_header(void *cls, enum MHD_ValueKind kind, const char *key, const char *value) {
+    header_list_t *list = cls;
+    (void)kind;
+    for(size_t i = 0; i < CORE_HEADERS; i++) {
+        if(strcasecmp(key, core_headers[i]) == 0)
+            return MHD_YES;
+    }
+    if(list->count == MAX_REQUEST_HEADERS)
+        return MHD_NO;
+    list->headers[list->count].name = key;
+    list->headers[list->count].value = value;
+    list->count++;
+    return MHD_YES;
+}
+
+// The whole request is there: hand it to the core, which answers some requests without asking the CoAP host
+static int forward_request(struct MHD_Connection *connection, http_request_t *record, const char *url,
+                           const char *method) {
+    header_list_t header_list = { .count = 0 };
+    for(size_t i = 0; i < CORE_HEADERS; i++) {
+        const char *value = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, core_headers[i]);
+        if(value != NULL) {
+            header_list.headers[header_list.count].name = core_headers[i];
+            header_list.headers[header_list.count].value = value;
+            header_list.count++;
+        }
+    }
+    MHD_get_connection_values(connection, MHD_HEADER_KIND, collect_header, &header_list);
+    const union MHD_ConnectionInfo *fd_info = MHD_get_connection_info(connection, MHD_CONNECTION_INFO_CONNECTION_FD);
+
+    http2coap_request_info_t info = {
+        .method = method,
+        .path = url,
+        .headers = header_list.headers,
+        .header_count = header_list.count,
+        .body = record->body,
+        .body_length = record->body_length,
+        .client_fd = fd_info != NULL ? fd_info->connect_fd : -1
+    };
+    switch(http2coap_request_prepare(record->request, &info)) {
+        case 0:
+            break;
+        case MHD_HTTP_NOT_ACCEPTABLE:
+            return send_simple_http_response(connection, MHD_HTTP_NOT_ACCEPTABLE, "You can't use this method in CoAP");
+        case MHD_HTTP_NOT_FOUND:
+            return send_simple_http_response(connection, MHD_HTTP_NOT_FOUND, "No such resource on the CoAP host");
+        default:
+            return send_simple_http_response(connection, MHD_HTTP_INTERNAL_SERVER_ERROR, "Out of memory");
+    }
+
+    // Wait for the response while the CoAP thread does its job, we are resumed by http_request_event()
+    record->submitted = 1;
+    MHD_suspend_connection(connection);
+    http2coap_request_submit(record->request, http_request_event, record);
+    return MHD_YES;
+}
+
+// We have been resumed by the CoAP thread, the response is ready.
+// Its body belongs to the request, which is released by http_request_completed() once it has been sent.
+static int queue_coap_response(struct MHD_Connection *connection, http_request_t *record) {
+    const http2coap_response_t *coap_response = record->response;
+    struct MHD_Response *response;
+    if(coap_response->streamed)
+        response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 1024, read_streamed_body, record, NULL);
+    else
+        response = MHD_create_response_from_buffer(coap_response->body_length, (void *)coap_response->body,
+                                                   MHD_RESPMEM_PERSISTENT);
+    if(response == NULL)
+        return MHD_NO;
+
+    const char *content_type = "unknown";
+    for(size_t i = 0; i < coap_response->header_count; i++) {
+        MHD_add_response_header(response, coap_response->headers[i].name, coap_response->headers[i].value);
+        if(strcmp(coap_response->headers[i].name, MHD_HTTP_HEADER_CONTENT_TYPE) == 0)
+            content_type = coap_response->headers[i].value;
+    }
+
+    http2coap_request_trace(record->request, "response_queued");
+    int result = MHD_queue_response(connection, coap_response->status, response);
+    MHD_destroy_response(response);
+
+    const struct sockaddr_in *client_addr = (const struct sockaddr_in *)
+            MHD_get_connection_info(connection, MHD_CONNECTION_INFO_CLIENT_ADDRESS)->client_addr;
+    if(coap_response->streamed)
+        printf("HTTP %13s:%-5u <- %u %s [ %s, streamed ]\n", inet_ntoa(client_addr->sin_addr),
+               ntohs(client_addr->sin_port), coap_response->status, http_reason_phrase_for(coap_response->status),
+               content_type);
+    else
+        printf("HTTP %13s:%-5u <- %u %s [ %s, %zu bytes, \"%.*s\" ]\n", inet_ntoa(client_addr->sin_addr),
+               ntohs(client_addr->sin_port), coap_response->status, http_reason_phrase_for(coap_response->status),
+               content_type, coap_response->body_length, (int)coap_response->body_length,
+               coap_response->body != NULL ? (const char *)coap_response->body : "");
+    return result;
 }
 
 // Where HTTP requests are processed
 static int http_request_handler(void *cls, struct MHD_Connection *connection, const char *url, const char *method,
                                 const char *version, const char *upload_data, size_t *upload_data_size, void **con_cls) {
-    // Check if we already handled this connection
-    if(*con_cls == connection)
-        return MHD_YES;
-    else
-        *con_cls = connection;
+    http2coap_context_t *context = cls;
+    http_request_t *record = *con_cls;
+
+    if(record == NULL)
+        return send_simple_http_response(connection, MHD_HTTP_INTERNAL_SERVER_ERROR, "Out of memory");
+
+    // Later calls for a request we already accepted
+    if(record->accepted) {
+        // The body becomes the CoAP payload
+        if(*upload_data_size != 0) {
+            if(record->body_length + *upload_data_size > MAX_REQUEST_BODY) {
+                record->body_too_large = 1;
+            }
+            else {
+                memcpy(record->body + record->body_length, upload_data, *upload_data_size);
+                record->body_length += *upload_data_size;
+            }
+            *upload_data_size = 0;
+            return MHD_YES;
+        }
+
+        if(!record->submitted) {
+            if(record->body_too_large)
+                return send_simple_http_response(connection, MHD_HTTP_REQUEST_ENTITY_TOO_LARGE,
+                                                 "Request body does not fit in a CoAP message");
+            return forward_request(connection, record, url, method);
+        }
+
+        // The client went away while we were suspended
+        if(record->cancelled)
+            return MHD_NO;
+
+        return queue_coap_response(connection, record);
+    }
 
     const struct sockaddr_in *client_addr = (const struct sockaddr_in *)
             MHD_get_connection_info(connection, MHD_CONNECTION_INFO_CLIENT_ADDRESS)->client_addr;
     printf("HTTP %13s:%-5u -> %s %s\n", inet_ntoa(client_addr->sin_addr), ntohs(client_addr->sin_port), method, url);
+    http2coap_request_trace(record->request, "headers");
 
     // Send static file when URL matches any
     if(strcmp("GET", method) == 0
        && static_files_path[0] != '\0'
        && strstr(url, "..") == NULL) {
-        static char file_path[255];
+        char file_path[255];
         snprintf(file_path, sizeof(file_path), "%s/%s", static_files_path, url);
 
         struct stat sbuf;
@@ -98,122 +341,37 @@ static int http_request_handler(void *cls, struct MHD_Connection *connection, co
         }
     }
 
-    // Define Method
-    method_t coap_method;
-    if(strcmp(MHD_HTTP_METHOD_GET, method) == 0) {
-        coap_method = COAP_REQUEST_GET;
-    }
-    else if(strcmp(MHD_HTTP_METHOD_POST, method) == 0) {
-        coap_method = COAP_REQUEST_POST;
-    }
-    else if(strcmp(MHD_HTTP_METHOD_PUT, method) == 0) {
-        coap_method = COAP_REQUEST_PUT;
-    }
-    else if(strcmp(MHD_HTTP_METHOD_DELETE, method) == 0) {
-        coap_method = COAP_REQUEST_DELETE;
-    }
-    else {
-        return send_simple_http_response(connection, MHD_HTTP_NOT_ACCEPTABLE, "You can't use this method in CoAP");
-    }
-
-    // Add URI if any
-    coap_list_t *options_list = NULL;
-    if(strlen(url) - 1 > 0) {
-#define BUFSIZE 40
-        unsigned char _buf[BUFSIZE];
-        unsigned char *buf = _buf;
-        size_t buflen = BUFSIZE;
-        int res = coap_split_query((const unsigned char *)url + 1, strlen(url) - 1, buf, &buflen);
-
-        while(res--) {
-            coap_insert(&options_list, new_option_node(COAP_OPTION_URI_PATH,
-                                                       COAP_OPT_LENGTH(buf), COAP_OPT_VALUE(buf)));
-            buf += COAP_OPT_SIZE(buf);
-        }
-    }
-
-    // Create packet
-    coap_pdu_t *pdu;
-    if(!(pdu = coap_new_request(coap_context, coap_method, &options_list, NULL, 0)))
-        coap_abort_to_http(connection, "coap_new_request: request creation failed\n");
-
-    // Create destination address
-    coap_address_t destination_address;
-    memcpy(&destination_address.addr.sin, &destination, sizeof(destination));
-    destination_address.size = sizeof(destination);
-
-    printf("COAP %13s:%-5u <- ",
-           inet_ntoa((&destination_address.addr.sin)->sin_addr),
-           ntohs((&destination_address.addr.sin)->sin_port));
-    coap_show_pdu(pdu);
-
-    // Send the message to the queue
-    if(coap_send_confirmed(coap_context, coap_context->endpoint, &destination_address, pdu) == COAP_INVALID_TID)
-        return coap_abort_to_http(connection, "coap_send_confirmed: could not send CoAP message\n");
-
-    // Keep a trace of this HTTP connection so we can send the response later
-    for(int i = 0; i < MAX_HTTP_CONNECTIONS; i++) {
-        if(http_coap_pairs[i].connection == NULL) {
-            http_coap_pairs[i].connection = connection;
-            http_coap_pairs[i].message_id = pdu->hdr->id;
-            break;
-        }
-    }
-
-    fd_set readfds;
-    coap_tick_t now;
-    coap_queue_t *next_pdu;
-
-    unsigned int wait_seconds = 10;         /* default timeout in seconds */
-    coap_tick_t max_wait;                   /* global timeout (changed by set_timeout()) */
-    coap_ticks(&max_wait);
-    max_wait += wait_seconds * COAP_TICKS_PER_SECOND;
+    // Scheduler statistics
+    if(strcmp("GET", method) == 0 && strcmp(url, PROXY_STATUS_PREFIX "scheduler") == 0)
+        return send_stats_page(connection, context, http2coap_scheduler_stats);
 
-    // while there are messages to dispatch
-    while(!coap_can_exit(coap_context)) {
-        FD_ZERO(&readfds);
-        FD_SET(coap_context->sockfd, &readfds);
+    // Batching of the datagrams on the CoAP socket
+    if(strcmp("GET", method) == 0 && strcmp(url, PROXY_STATUS_PREFIX "io") == 0)
+        return send_stats_page(connection, context, http2coap_io_stats);
 
-        next_pdu = coap_peek_next(coap_context);
-
-        coap_ticks(&now);
-        while(next_pdu && next_pdu->t <= now - coap_context->sendqueue_basetime) {
-            printf("COAP %13s:%-5u <- (retransmit) ",
-                   inet_ntoa((&destination_address.addr.sin)->sin_addr),
-                   ntohs((&destination_address.addr.sin)->sin_port));
-            coap_show_pdu(pdu);
-
-            coap_retransmit(coap_context, coap_pop_next(coap_context));
-            next_pdu = coap_peek_next(coap_context);
-        }
+    // Hedged requests to the replicas of the upstream
+    if(strcmp("GET", method) == 0 && strcmp(url, PROXY_STATUS_PREFIX "hedge") == 0)
+        return send_stats_page(connection, context, http2coap_hedge_stats);
 
-        // Now wait for responses for 5 seconds
-        struct timeval tv;
-        tv.tv_sec = 5;
-        tv.tv_usec = 0;
-
-        int result = select(coap_context->sockfd + 1, &readfds, 0, 0, &tv);
-
-        if(result < 0) {   /* error */
-            perror("select");
-        }
-        else if(result > 0) {  /* read from socket */
-            if(FD_ISSET(coap_context->sockfd, &readfds)) {
-                coap_read(coap_context);       /* read received data */
-                break; // we received a response, so we quit this send loop
-            }
-            else {
-                fprintf(stderr, "not reading since not the right socket\n");
-            }
-        }
-        else { /* timeout */
-            fprintf(stderr, "select timeout\n");
-            coap_ticks(&now);
-            if(max_wait <= now) {
-                return coap_abort_to_http(connection, "CoAP service took too long to respond\n");
-            }
-        }
+    // Merged resource directory of the upstreams
+    if(strcmp("GET", method) == 0 && strcmp(url, PROXY_STATUS_PREFIX "directory") == 0) {
+        char *json;
+        size_t length = http2coap_directory_json(context, &json);
+        if(json == NULL)
+            return send_simple_http_response(connection, MHD_HTTP_INTERNAL_SERVER_ERROR, "Out of memory");
+        struct MHD_Response *response = MHD_create_response_from_buffer(length, json, MHD_RESPMEM_MUST_FREE);
+        MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, "application/json");
+        int result = MHD_queue_response(connection, MHD_HTTP_OK, response);
+        MHD_destroy_response(response);
+        return result;
     }
 
+    // Enforce rate limits before doing any CoAP work
+    unsigned int retry_after = rate_limit_check((const struct sockaddr *)client_addr, url);
+    if(retry_after != 0)
+        return send_rate_limited_http_response(connection, retry_after);
+
+    // Forwarded once the whole request is in
+    record->accepted = 1;
     return MHD_YES; // the connection was handled successfully,
-}
\ No newline at end of file
+}
@@ -2,22 +2,29 @@
 #define HTTP2COAP_HTTP_SERVER_H
 
 #include <microhttpd.h>
-#include <coap/pdu.h>
+#include "http2coap.h"
+
+#ifndef MHD_HTTP_TOO_MANY_REQUESTS
+#define MHD_HTTP_TOO_MANY_REQUESTS 429
+#endif
+#ifndef MHD_HTTP_HEADER_RETRY_AFTER
+#define MHD_HTTP_HEADER_RETRY_AFTER "Retry-After"
+#endif
 
 extern struct MHD_Daemon *http_daemon;
 extern char static_files_path[64];
-extern struct sockaddr_in destination;
 
-void start_http_server(uint16_t port);
+// Serves HTTP with microhttpd and forwards the requests to the proxy core of context
+void start_http_server(uint16_t port, http2coap_context_t *context);
 
 int send_simple_http_response(struct MHD_Connection *connection, unsigned int status_code, const char *data);
-int coap_abort_to_http(struct MHD_Connection *connection, const char *message);
 
-typedef struct {
-    struct MHD_Connection *connection;
-    unsigned short message_id;
-} http_coap_pair_t;
+// Internal pages served by the proxy itself rather than forwarded to the CoAP host
+#define PROXY_STATUS_PREFIX "/.http2coap/"
+
 #define MAX_HTTP_CONNECTIONS 64
-extern http_coap_pair_t http_coap_pairs[MAX_HTTP_CONNECTIONS];
+// Bodies beyond this are refused rather than forwarded, a CoAP payload has to fit in one datagram
+#define MAX_REQUEST_BODY 1024
+#define MAX_REQUEST_HEADERS 32
 
 #endif //HTTP2COAP_HTTP_SERVER_H
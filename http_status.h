@@ -0,0 +1,21 @@
+#ifndef HTTP2COAP_HTTP_STATUS_H
+#define HTTP2COAP_HTTP_STATUS_H
+
+// What the proxy core answers with, it does not depend on an HTTP library for these
+#define HTTP_OK 200
+#define HTTP_CREATED 201
+#define HTTP_ACCEPTED 202
+#define HTTP_NO_CONTENT 204
+#define HTTP_BAD_REQUEST 400
+#define HTTP_NOT_FOUND 404
+#define HTTP_NOT_ACCEPTABLE 406
+#define HTTP_UNSUPPORTED_MEDIA_TYPE 415
+#define HTTP_INTERNAL_SERVER_ERROR 500
+#define HTTP_NOT_IMPLEMENTED 501
+#define HTTP_BAD_GATEWAY 502
+#define HTTP_SERVICE_UNAVAILABLE 503
+#define HTTP_GATEWAY_TIMEOUT 504
+
+#define HTTP_HEADER_CONTENT_TYPE "Content-Type"
+
+#endif //HTTP2COAP_HTTP_STATUS_H
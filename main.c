@@ -7,14 +7,27 @@
 #include <signal.h>
 #include <libgen.h>
 #include <sys/stat.h>
+#include <coap/coap.h>
+#include "http2coap.h"
 #include "http_server.h"
-#include "coap_handler.h"
-#include "coap_client.h"
+#include "rate_limit.h"
+
+static http2coap_context_t *proxy = NULL;
 
 static void cleanup() {
     fprintf(stderr, "Exiting...\n");
-    if(coap_context) coap_free_context(coap_context); coap_context = NULL;
-    if(http_daemon) MHD_stop_daemon(http_daemon); http_daemon = NULL;
+    // The core goes first: it cancels what is pending and resumes the suspended connections, which
+    // microhttpd needs before it can stop
+    if(proxy) http2coap_stop(proxy);
+    http2coap_trace_close();
+    if(http_daemon) {
+        MHD_stop_daemon(http_daemon);
+        http_daemon = NULL;
+    }
+    if(proxy) {
+        http2coap_free(proxy);
+        proxy = NULL;
+    }
 }
 
 struct sigaction old_action;
@@ -29,25 +42,47 @@ static void signal_handler(int sig_no)
 int main(int argc, char *argv[])
 {
     int opt;
-    str destination_hostname = {.length = 0, .s = NULL};
-    uint16_t server_port = 8080, destination_port = COAP_DEFAULT_PORT;
+    uint16_t server_port = 8080;
     char *endptr;
     struct stat s;
+    double trace_sample_rate = 0;
+    double timeout_seconds;
+    const char *trace_path = "http2coap-trace.json";
 
-    while((opt = getopt(argc, argv, "D:P:p:f:h")) != EOF) {
+    // Everything but the HTTP side is configured on the proxy core
+    proxy = http2coap_new();
+    if(proxy == NULL)
+        return EXIT_FAILURE;
+    http2coap_config_t *config = http2coap_config(proxy);
+
+    while((opt = getopt(argc, argv, "D:P:R:H:p:f:l:L:n:w:c:M:W:r:N:T:S:t:h")) != EOF) {
         switch(opt) {
             case 'D':
-                destination_hostname.s = (unsigned char *)optarg;
-                destination_hostname.length = strlen(optarg);
-                resolve_address(&destination_hostname, (struct sockaddr *)&destination);
+                config->coap_host = optarg;
                 break;
             case 'P':
-                destination_port = (uint16_t)strtoul(optarg, &endptr, 10);
+                config->coap_port = (uint16_t)strtoul(optarg, &endptr, 10);
                 if(*endptr != '\0') {
                     fprintf(stderr, "error: invalid port number: %s\n", optarg);
                     return EXIT_FAILURE;
                 }
                 break;
+            case 'R':
+                if(http2coap_add_replica(proxy, optarg) != 0) {
+                    fprintf(stderr, "error: invalid replica: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'H':
+                config->hedge_percentile = (unsigned int)strtoul(optarg, &endptr, 10);
+                if(*endptr == '/')
+                    config->hedge_max_percent = (unsigned int)strtoul(endptr + 1, &endptr, 10);
+                if(*endptr != '\0' || config->hedge_percentile == 0 || config->hedge_percentile > 99
+                   || config->hedge_max_percent == 0 || config->hedge_max_percent > 100) {
+                    fprintf(stderr, "error: invalid hedging: %s (expected percentile[/max_percent])\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
             case 'p':
                 server_port = (uint16_t)strtoul(optarg, &endptr, 10);
                 if(*endptr != '\0') {
@@ -80,8 +115,94 @@ int main(int argc, char *argv[])
                     }
                 }
                 break;
+            case 'l':
+                if(rate_limit_set_client(optarg) != 0) {
+                    fprintf(stderr, "error: invalid client rate limit: %s (expected rate[/burst])\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'L':
+                if(rate_limit_add_route(optarg) != 0) {
+                    fprintf(stderr, "error: invalid route rate limit: %s (expected /prefix=rate[/burst])\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'n':
+                config->max_in_flight = (unsigned int)strtoul(optarg, &endptr, 10);
+                if(*endptr != '\0' || config->max_in_flight == 0 || config->max_in_flight > HTTP2COAP_MAX_IN_FLIGHT) {
+                    fprintf(stderr, "error: invalid number of exchanges in flight: %s (1 to %d)\n", optarg,
+                            HTTP2COAP_MAX_IN_FLIGHT);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'w':
+                if(http2coap_set_weights(proxy, optarg) != 0) {
+                    fprintf(stderr, "error: invalid priority weights: %s (expected high,normal,bulk)\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'c':
+                if(http2coap_add_priority_rule(proxy, optarg) != 0) {
+                    fprintf(stderr, "error: invalid priority rule: %s (expected [METHOD:]/prefix=high|normal|bulk)\n",
+                            optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'M':
+                if(http2coap_add_multicast_route(proxy, optarg) != 0) {
+                    fprintf(stderr, "error: invalid multicast route: %s (expected /prefix=group_address[%%interface])\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'W':
+                config->multicast_window_ms = (unsigned int)strtoul(optarg, &endptr, 10);
+                if(*endptr != '\0' || config->multicast_window_ms == 0) {
+                    fprintf(stderr, "error: invalid multicast window: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'r':
+                config->resource_directory_refresh_seconds = (unsigned int)strtoul(optarg, &endptr, 10);
+                if(*endptr != '\0') {
+                    fprintf(stderr, "error: invalid resource directory refresh period: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'N':
+                config->negative_cache_ttl_seconds = (unsigned int)strtoul(optarg, &endptr, 10);
+                if(*endptr != '\0') {
+                    fprintf(stderr, "error: invalid negative cache TTL: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'T':
+                timeout_seconds = strtod(optarg, &endptr);
+                if(endptr == optarg || *endptr != '\0'
+                   || !(timeout_seconds >= 0.001 && timeout_seconds <= HTTP2COAP_MAX_TIMEOUT_MS / 1000.0)) {
+                    fprintf(stderr, "error: invalid request timeout: %s (0.001 to %u seconds)\n", optarg,
+                            HTTP2COAP_MAX_TIMEOUT_MS / 1000);
+                    return EXIT_FAILURE;
+                }
+                config->request_timeout_max_ms = (unsigned int)(timeout_seconds * 1000);
+                break;
+            case 'S':
+                trace_sample_rate = strtod(optarg, &endptr);
+                if(*endptr != '\0' || trace_sample_rate < 0 || trace_sample_rate > 1) {
+                    fprintf(stderr, "error: invalid trace sampling rate: %s (0 to 1)\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 't':
+                trace_path = optarg;
+                break;
             case 'h':
-                fprintf(stderr, "usage: %s -D coap_host [-P coap_port] [-p HTTP_server_port] [-f static_files_dir]\n",
+                fprintf(stderr, "usage: %s -D coap_host [-P coap_port] [-R replica_host]... [-H percentile[/max_percent]]\n"
+                                "       [-p HTTP_server_port] [-f static_files_dir]\n"
+                                "       [-l client_rate[/burst]] [-L /route_prefix=rate[/burst]]...\n"
+                                "       [-n exchanges_in_flight] [-w high,normal,bulk] [-c [METHOD:]/route_prefix=class]...\n"
+                                "       [-M /route_prefix=multicast_group[%%interface]]... [-W multicast_window_ms]\n"
+                                "       [-r directory_refresh_seconds] [-N not_found_ttl_seconds] [-T max_request_seconds]\n"
+                                "       [-S trace_sampling_rate] [-t trace_file]\n",
                         basename(argv[0]));
                 return EXIT_SUCCESS;
             default:
@@ -89,12 +210,16 @@ int main(int argc, char *argv[])
         }
     }
 
-    if(destination_hostname.s == NULL) {
+    if(config->coap_host == NULL) {
         fprintf(stderr, "error: please specify the target coap host of the proxy with the -D option\n");
         return EXIT_FAILURE;
     }
 
-    destination.sin_port = htons(destination_port);
+    if(trace_sample_rate > 0) {
+        if(http2coap_trace_open(trace_path, trace_sample_rate) != 0)
+            return EXIT_FAILURE;
+        fprintf(stderr, "Tracing %g of the requests to '%s'\n", trace_sample_rate, trace_path);
+    }
 
     // Register the clean function for when the program exists
     if(atexit(cleanup) != 0) {
@@ -110,7 +235,12 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    start_http_server(server_port);
+    // Start the CoAP side first, microhttpd hands it requests as soon as it runs
+    coap_set_log_level(LOG_DEBUG);
+    if(http2coap_start(proxy) != 0)
+        return EXIT_FAILURE;
+
+    start_http_server(server_port, proxy);
     if(http_daemon == NULL) {
         fprintf(stderr, "error: HTTP server failed to start: %s\n", strerror(errno));
         return EXIT_FAILURE;
@@ -118,11 +248,6 @@ int main(int argc, char *argv[])
 
     fprintf(stderr, "HTTP server is listening on port %u (using libmicrohttpd %s)\n", server_port, MHD_get_version());
 
-    // Create the CoAP context
-    coap_set_log_level(LOG_DEBUG);
-    coap_context = coap_create_context("0.0.0.0", NULL);
-    coap_register_response_handler(coap_context, coap_response_handler);
-
     // Now let microhttpd accept HTTP requests and wait for a signal
     pause();
 
@@ -0,0 +1,429 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include "multicast.h"
+#include "context.h"
+#include "coap_client.h"
+#include "http_status.h"
+
+// One response as it will be written in the aggregated JSON array
+typedef struct multicast_result_t {
+    struct multicast_result_t *next;
+    size_t length;
+    char text[];
+} multicast_result_t;
+
+// Collection state of a fan-out exchange, allocated in its arena
+typedef struct multicast_state_t {
+    exchange_t *exchange;
+    int sockfd;
+    unsigned char token[4];
+    coap_tick_t window_end;
+
+    pthread_mutex_t lock;               // everything below is shared with the thread of the caller
+    multicast_result_t *head, *tail;
+    multicast_result_t *cursor;         // next result to hand to the caller
+    size_t cursor_offset;
+    unsigned int count;
+    int collecting;                     // the window is still open
+    int suspended;                      // the reader is waiting for more results
+    int http_active;                    // the caller still uses the exchange
+    int opening_sent;
+    int closing_sent;
+    struct multicast_state_t *next_active;
+} multicast_state_t;
+
+int multicast_add_route(multicast_t *multicast, const char *spec) {
+    if(multicast->routes_count == MAX_MULTICAST_ROUTES) {
+        fprintf(stderr, "error: too many multicast routes (max %d)\n", MAX_MULTICAST_ROUTES);
+        return -1;
+    }
+
+    multicast_route_t *route = &multicast->routes[multicast->routes_count];
+    memset(route, 0, sizeof(*route));
+
+    const char *equal = strchr(spec, '=');
+    if(spec[0] != '/' || equal == NULL || (size_t)(equal - spec) >= sizeof(route->prefix))
+        return -1;
+    memcpy(route->prefix, spec, equal - spec);
+
+    // The outgoing interface follows a '%', for both families
+    char group[INET6_ADDRSTRLEN];
+    const char *interface = strchr(equal + 1, '%');
+    size_t group_length = interface != NULL ? (size_t)(interface - equal - 1) : strlen(equal + 1);
+    if(group_length >= sizeof(group))
+        return -1;
+    memcpy(group, equal + 1, group_length);
+    group[group_length] = '\0';
+    if(interface != NULL) {
+        // A name like eth0, or an index
+        char *endptr;
+        route->interface = if_nametoindex(interface + 1);
+        if(route->interface == 0) {
+            route->interface = (unsigned int)strtoul(interface + 1, &endptr, 10);
+            if(*endptr != '\0')
+                route->interface = 0;
+        }
+        if(route->interface == 0) {
+            fprintf(stderr, "error: unknown interface: %s\n", interface + 1);
+            return -1;
+        }
+    }
+
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_NUMERICHOST;
+    int error = getaddrinfo(group, NULL, &hints, &result);
+    if(error != 0) {
+        fprintf(stderr, "getaddrinfo: %s: %s\n", group, gai_strerror(error));
+        return -1;
+    }
+    memcpy(&route->group, result->ai_addr, result->ai_addrlen);
+    route->group_length = result->ai_addrlen;
+    freeaddrinfo(result);
+    if(route->group.ss_family == AF_INET6)
+        ((struct sockaddr_in6 *)&route->group)->sin6_scope_id = route->interface;
+
+    int is_multicast = route->group.ss_family == AF_INET6
+                       ? IN6_IS_ADDR_MULTICAST(&((struct sockaddr_in6 *)&route->group)->sin6_addr)
+                       : IN_MULTICAST(ntohl(((struct sockaddr_in *)&route->group)->sin_addr.s_addr));
+    if(!is_multicast) {
+        fprintf(stderr, "error: %s is not a multicast address\n", equal + 1);
+        return -1;
+    }
+
+    multicast->routes_count++;
+    return 0;
+}
+
+const multicast_route_t *multicast_route_for(const multicast_t *multicast, const char *url, const char **path) {
+    for(int i = 0; i < multicast->routes_count; i++) {
+        const multicast_route_t *route = &multicast->routes[i];
+        size_t length = strlen(route->prefix);
+        if(strncmp(url, route->prefix, length) == 0 && (url[length] == '/' || url[length] == '\0')) {
+            *path = url + length;
+            return route;
+        }
+    }
+    return NULL;
+}
+
+// Once neither thread uses the state, the last one to let go releases the exchange
+static void release_state(multicast_state_t *state) {
+    pthread_mutex_destroy(&state->lock);
+    exchange_free(state->exchange);
+}
+
+ssize_t multicast_read_body(exchange_t *exchange, char *buf, size_t max) {
+    multicast_state_t *state = exchange->multicast;
+    size_t written = 0;
+
+    pthread_mutex_lock(&state->lock);
+    if(!state->opening_sent && max > 0) {
+        buf[written++] = '[';
+        state->opening_sent = 1;
+    }
+    while(written < max) {
+        if(state->cursor == NULL) {
+            if(state->head == NULL)
+                break;
+            state->cursor = state->head;
+            state->cursor_offset = 0;
+        }
+        else if(state->cursor_offset == state->cursor->length) {
+            if(state->cursor->next == NULL)
+                break;
+            state->cursor = state->cursor->next;
+            state->cursor_offset = 0;
+        }
+
+        size_t length = state->cursor->length - state->cursor_offset;
+        if(length > max - written)
+            length = max - written;
+        memcpy(buf + written, state->cursor->text + state->cursor_offset, length);
+        state->cursor_offset += length;
+        written += length;
+    }
+
+    int drained = state->cursor == NULL ? state->head == NULL
+                                        : state->cursor_offset == state->cursor->length && state->cursor->next == NULL;
+    if(drained && !state->collecting) {
+        if(!state->closing_sent && written + 3 <= max) {
+            memcpy(buf + written, "\n]\n", 3);
+            written += 3;
+            state->closing_sent = 1;
+        }
+        if(written == 0) {
+            pthread_mutex_unlock(&state->lock);
+            return -1;
+        }
+    }
+    else if(written == 0) {
+        // Nothing yet: the caller waits until the CoAP thread tells it there is more
+        state->suspended = 1;
+        exchange->callback(exchange, HTTP2COAP_BODY_WAIT, NULL, exchange->callback_arg);
+    }
+    pthread_mutex_unlock(&state->lock);
+    return (ssize_t)written;
+}
+
+// Must be called with the state locked, so that the caller cannot release the exchange meanwhile
+static void wake_reader(multicast_state_t *state) {
+    if(state->suspended && state->http_active) {
+        exchange_t *exchange = state->exchange;
+        state->suspended = 0;
+        exchange->callback(exchange, HTTP2COAP_BODY_READY, NULL, exchange->callback_arg);
+    }
+}
+
+static void append_result(multicast_state_t *state, const char *text, size_t length) {
+    multicast_result_t *result = arena_alloc(&state->exchange->arena, sizeof(multicast_result_t) + length);
+    if(result == NULL)
+        return;
+    result->next = NULL;
+    result->length = length;
+    memcpy(result->text, text, length);
+
+    pthread_mutex_lock(&state->lock);
+    if(state->tail)
+        state->tail->next = result;
+    else
+        state->head = result;
+    state->tail = result;
+    state->count++;
+    wake_reader(state);
+    pthread_mutex_unlock(&state->lock);
+}
+
+void multicast_start(exchange_t *exchange, unsigned short port) {
+    http2coap_context_t *context = exchange->context;
+    const multicast_route_t *route = exchange->multicast_route;
+
+    multicast_state_t *state = arena_alloc(&exchange->arena, sizeof(multicast_state_t));
+    if(state == NULL) {
+        exchange_fail(exchange, HTTP_INTERNAL_SERVER_ERROR, "multicast: out of memory\n");
+        return;
+    }
+    memset(state, 0, sizeof(*state));
+    state->exchange = exchange;
+    pthread_mutex_init(&state->lock, NULL);
+    for(size_t i = 0; i < sizeof(state->token); i++)
+        state->token[i] = (unsigned char)random();
+
+    state->sockfd = socket(route->group.ss_family, SOCK_DGRAM, 0);
+    if(state->sockfd == -1) {
+        perror("socket");
+        pthread_mutex_destroy(&state->lock);
+        exchange_fail(exchange, HTTP_BAD_GATEWAY, "multicast: cannot create socket\n");
+        return;
+    }
+
+    struct sockaddr_storage group;
+    memcpy(&group, &route->group, route->group_length);
+    if(group.ss_family == AF_INET6) {
+        struct sockaddr_in6 *group6 = (struct sockaddr_in6 *)&group;
+        group6->sin6_port = htons(port);
+        if(group6->sin6_scope_id != 0)
+            setsockopt(state->sockfd, IPPROTO_IPV6, IPV6_MULTICAST_IF, &group6->sin6_scope_id,
+                       sizeof(group6->sin6_scope_id));
+    }
+    else {
+        ((struct sockaddr_in *)&group)->sin_port = htons(port);
+        if(route->interface != 0) {
+            struct ip_mreqn mreq;
+            memset(&mreq, 0, sizeof(mreq));
+            mreq.imr_ifindex = (int)route->interface;
+            setsockopt(state->sockfd, IPPROTO_IP, IP_MULTICAST_IF, &mreq, sizeof(mreq));
+        }
+    }
+
+    // One NON request with a token of its own, every node answers it with a separate response
+    str token = { sizeof(state->token), state->token };
+    coap_pdu_t *pdu = coap_new_request(context->coap_context, exchange->method, &token, &exchange->options,
+                                       exchange->payload, exchange->payload_length);
+    if(pdu == NULL) {
+        close(state->sockfd);
+        pthread_mutex_destroy(&state->lock);
+        exchange_fail(exchange, HTTP_BAD_GATEWAY, "coap_new_request: request creation failed\n");
+        return;
+    }
+    pdu->hdr->type = COAP_MESSAGE_NON;
+
+    char group_str[INET6_ADDRSTRLEN];
+    getnameinfo((struct sockaddr *)&group, route->group_length, group_str, sizeof(group_str), NULL, 0, NI_NUMERICHOST);
+    printf("COAP %13s:%-5u <- (multicast) ", group_str, port);
+    coap_show_pdu(pdu);
+
+    ssize_t sent = sendto(state->sockfd, pdu->hdr, pdu->length, 0, (struct sockaddr *)&group, route->group_length);
+    coap_delete_pdu(pdu);
+    if(sent == -1) {
+        perror("sendto");
+        close(state->sockfd);
+        pthread_mutex_destroy(&state->lock);
+        exchange_fail(exchange, HTTP_BAD_GATEWAY, "multicast: could not send CoAP message\n");
+        return;
+    }
+    TRACE_EVENT(exchange, "send");
+
+    coap_tick_t now;
+    coap_ticks(&now);
+    uint64_t window_ms = context->config.multicast_window_ms;
+    state->window_end = now + (coap_tick_t)(window_ms * COAP_TICKS_PER_SECOND / 1000);
+    state->collecting = 1;
+    state->http_active = 1;
+    exchange->multicast = state;
+    state->next_active = context->multicast.active;
+    context->multicast.active = state;
+
+    // The status is known right away, the body follows as responses arrive
+    exchange_add_header(exchange, HTTP_HEADER_CONTENT_TYPE, "application/json");
+    if(!exchange_stream(exchange, HTTP_OK)) {
+        // Released while queued, the window still runs its course to free the exchange
+        pthread_mutex_lock(&state->lock);
+        state->http_active = 0;
+        pthread_mutex_unlock(&state->lock);
+    }
+}
+
+int multicast_fill_fdset(multicast_t *multicast, fd_set *readfds, int max_fd) {
+    for(multicast_state_t *state = multicast->active; state != NULL; state = state->next_active) {
+        FD_SET(state->sockfd, readfds);
+        if(state->sockfd > max_fd)
+            max_fd = state->sockfd;
+    }
+    return max_fd;
+}
+
+// Appends s to the JSON string being built in out, escaping what needs to be
+static size_t json_escape(char *out, size_t size, const unsigned char *s, size_t length) {
+    size_t written = 0;
+    for(size_t i = 0; i < length && written + 7 < size; i++) {
+        unsigned char c = s[i];
+        if(c == '"' || c == '\\') {
+            out[written++] = '\\';
+            out[written++] = (char)c;
+        }
+        else if(c < 0x20 || c >= 0x7f) {
+            written += snprintf(out + written, size - written, "\\u%04x", c);
+        }
+        else {
+            out[written++] = (char)c;
+        }
+    }
+    return written;
+}
+
+static void read_response(multicast_state_t *state) {
+    unsigned char packet[COAP_MAX_PDU_SIZE];
+    struct sockaddr_storage source;
+    socklen_t source_length = sizeof(source);
+
+    ssize_t length = recvfrom(state->sockfd, packet, sizeof(packet), 0, (struct sockaddr *)&source, &source_length);
+    if(length <= 0) {
+        if(length == -1 && errno != EAGAIN)
+            perror("recvfrom");
+        return;
+    }
+
+    coap_pdu_t *pdu = coap_pdu_init(0, 0, 0, COAP_MAX_PDU_SIZE);
+    if(pdu == NULL)
+        return;
+    if(!coap_pdu_parse(packet, (size_t)length, pdu)
+       || pdu->hdr->token_length != sizeof(state->token)
+       || memcmp(pdu->hdr->token, state->token, sizeof(state->token)) != 0) {
+        coap_delete_pdu(pdu);
+        return;
+    }
+
+    char host[INET6_ADDRSTRLEN], port[8];
+    getnameinfo((struct sockaddr *)&source, source_length, host, sizeof(host), port, sizeof(port),
+                NI_NUMERICHOST | NI_NUMERICSERV);
+    printf("COAP %13s:%-5s -> (multicast) ", host, port);
+    coap_show_pdu(pdu);
+
+    // A confirmable response still needs its ACK
+    if(pdu->hdr->type == COAP_MESSAGE_CON) {
+        unsigned char ack[4] = { (COAP_DEFAULT_VERSION << 6) | (COAP_MESSAGE_ACK << 4), 0, 0, 0 };
+        memcpy(ack + 2, &pdu->hdr->id, 2);
+        sendto(state->sockfd, ack, sizeof(ack), 0, (struct sockaddr *)&source, source_length);
+    }
+
+    size_t data_length = 0;
+    unsigned char *data = NULL;
+    coap_get_data(pdu, &data_length, &data);
+
+    char text[64 + INET6_ADDRSTRLEN + 6 * COAP_MAX_PDU_SIZE];
+    size_t text_length = (size_t)snprintf(text, sizeof(text), "%s{\"source\":\"%s%s%s:%s\",\"code\":\"%u.%02u\",\"payload\":\"",
+                                          state->count ? ",\n" : "\n",
+                                          source.ss_family == AF_INET6 ? "[" : "", host,
+                                          source.ss_family == AF_INET6 ? "]" : "", port,
+                                          pdu->hdr->code >> 5, pdu->hdr->code & 0x1f);
+    text_length += json_escape(text + text_length, sizeof(text) - text_length - 3, data, data_length);
+    text_length += (size_t)snprintf(text + text_length, sizeof(text) - text_length, "\"}");
+    coap_delete_pdu(pdu);
+
+    append_result(state, text, text_length);
+}
+
+void multicast_read(multicast_t *multicast, fd_set *readfds) {
+    for(multicast_state_t *state = multicast->active; state != NULL; state = state->next_active) {
+        if(FD_ISSET(state->sockfd, readfds))
+            read_response(state);
+    }
+}
+
+// Stop collecting and let the reader finish the array, the state must be out of the active list already
+static void close_window(multicast_state_t *state) {
+    close(state->sockfd);
+    printf("COAP multicast window closed, %u response(s)\n", state->count);
+    pthread_mutex_lock(&state->lock);
+    state->collecting = 0;
+    wake_reader(state);
+    int unused = !state->http_active;
+    pthread_mutex_unlock(&state->lock);
+    if(unused)
+        release_state(state);
+}
+
+coap_tick_t multicast_expire(multicast_t *multicast, coap_tick_t now, coap_tick_t max_wait) {
+    multicast_state_t **link = &multicast->active;
+    while(*link != NULL) {
+        multicast_state_t *state = *link;
+        if(state->window_end > now) {
+            if(state->window_end - now < max_wait)
+                max_wait = state->window_end - now;
+            link = &state->next_active;
+            continue;
+        }
+
+        *link = state->next_active;
+        close_window(state);
+    }
+    return max_wait;
+}
+
+void multicast_close_all(multicast_t *multicast) {
+    while(multicast->active != NULL) {
+        multicast_state_t *state = multicast->active;
+        multicast->active = state->next_active;
+        close_window(state);
+    }
+}
+
+void multicast_release(exchange_t *exchange) {
+    multicast_state_t *state = exchange->multicast;
+    pthread_mutex_lock(&state->lock);
+    state->http_active = 0;
+    int unused = !state->collecting;
+    pthread_mutex_unlock(&state->lock);
+    if(unused)
+        release_state(state);
+}
@@ -0,0 +1,47 @@
+#ifndef HTTP2COAP_MULTICAST_H
+#define HTTP2COAP_MULTICAST_H
+
+#include <sys/select.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <coap/coap.h>
+#include "exchange.h"
+
+// A route whose requests are sent once, as NON, to a CoAP multicast group (e.g. ff02::fd or 224.0.1.187)
+// and answered with every unicast response received during the collection window
+typedef struct multicast_route_t {
+    char prefix[64];
+    struct sockaddr_storage group;
+    socklen_t group_length;
+    unsigned int interface;             // index of the outgoing interface, 0 lets the routes decide
+} multicast_route_t;
+
+#define MAX_MULTICAST_ROUTES 8
+
+// Fan-out routes of one context and its exchanges with an open window
+typedef struct {
+    multicast_route_t routes[MAX_MULTICAST_ROUTES];
+    int routes_count;
+    struct multicast_state_t *active;   // only touched by the CoAP thread
+} multicast_t;
+
+// Route spec is "/prefix=group[%interface]" like ff02::fd%eth0 or 224.0.1.187%lo
+int multicast_add_route(multicast_t *multicast, const char *spec);
+// Returns the route serving url, and sets *path to the part of url that follows the prefix
+const multicast_route_t *multicast_route_for(const multicast_t *multicast, const char *url, const char **path);
+
+// The following are only called from the CoAP thread
+void multicast_start(exchange_t *exchange, unsigned short port);
+int multicast_fill_fdset(multicast_t *multicast, fd_set *readfds, int max_fd);
+void multicast_read(multicast_t *multicast, fd_set *readfds);
+coap_tick_t multicast_expire(multicast_t *multicast, coap_tick_t now, coap_tick_t max_wait);
+// Closes every window right away, when the CoAP thread stops
+void multicast_close_all(multicast_t *multicast);
+
+// Streams "[", then the results as they come, then "]" once the window is closed.
+// Returns 0 when the caller has to wait for more and -1 at the end.
+ssize_t multicast_read_body(exchange_t *exchange, char *buf, size_t max);
+// The caller is done with the aggregated response
+void multicast_release(exchange_t *exchange);
+
+#endif //HTTP2COAP_MULTICAST_H
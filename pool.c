@@ -0,0 +1,41 @@
+#include <stdlib.h>
+#include "pool.h"
+
+void *pool_get(pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool_object_t *object = pool->free_list;
+    if(object != NULL) {
+        pool->free_list = object->next;
+        pool->free_count--;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if(object == NULL)
+        object = malloc(pool->object_size);
+    return object;
+}
+
+void pool_put(pool_t *pool, void *object) {
+    if(object == NULL)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    if(pool->free_count < pool->max_free) {
+        ((pool_object_t *)object)->next = pool->free_list;
+        pool->free_list = object;
+        pool->free_count++;
+        object = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    free(object);
+}
+
+void pool_preallocate(pool_t *pool, unsigned int count) {
+    for(unsigned int i = 0; i < count && pool->free_count < pool->max_free; i++) {
+        void *object = malloc(pool->object_size);
+        if(object == NULL)
+            return;
+        pool_put(pool, object);
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef HTTP2COAP_POOL_H
+#define HTTP2COAP_POOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+// Free list of fixed size objects, so that the records we need for every request are recycled
+// instead of going back and forth through malloc
+typedef struct pool_object_t {
+    struct pool_object_t *next;
+} pool_object_t;
+
+typedef struct {
+    size_t object_size;
+    unsigned int max_free;      // objects released beyond this are given back to malloc
+    unsigned int free_count;
+    pool_object_t *free_list;
+    pthread_mutex_t lock;
+} pool_t;
+
+#define POOL_INITIALIZER(object_size, max_free) \
+    { ((object_size) > sizeof(pool_object_t) ? (object_size) : sizeof(pool_object_t)), \
+      (max_free), 0, NULL, PTHREAD_MUTEX_INITIALIZER }
+
+void *pool_get(pool_t *pool);
+void pool_put(pool_t *pool, void *object);
+// Fill the free list ahead of time so that the first requests do not hit malloc either
+void pool_preallocate(pool_t *pool, unsigned int count);
+
+#endif //HTTP2COAP_POOL_H
@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <arpa/inet.h>
+#include "http2coap.h"
+#include "context.h"
+#include "coap_client.h"
+#include "exchange.h"
+#include "scheduler.h"
+#include "multicast.h"
+#include "resource_directory.h"
+#include "coap_io.h"
+#include "hedge.h"
+#include "trace.h"
+#include "http_status.h"
+
+http2coap_context_t *http2coap_new(void) {
+    http2coap_context_t *context = calloc(1, sizeof(http2coap_context_t));
+    if(context == NULL) {
+        perror("http2coap_new");
+        return NULL;
+    }
+    context->config.coap_port = COAP_DEFAULT_PORT;
+    context->config.max_in_flight = 1;
+    context->config.request_timeout_max_ms = 10000;
+    context->config.multicast_window_ms = 2000;
+    context->config.resource_directory_refresh_seconds = 0;
+    context->config.negative_cache_ttl_seconds = 30;
+    context->config.hedge_percentile = 0;
+    context->config.hedge_max_percent = 10;
+    context->wakeup_pipe[0] = context->wakeup_pipe[1] = -1;
+
+    scheduler_init(&context->scheduler);
+    resource_directory_init(&context->resource_directory);
+    coap_io_init(&context->io);
+    hedge_init(&context->hedge);
+    exchange_pool_preallocate(HTTP2COAP_MAX_IN_FLIGHT);
+    return context;
+}
+
+http2coap_config_t *http2coap_config(http2coap_context_t *context) {
+    return &context->config;
+}
+
+int http2coap_set_weights(http2coap_context_t *context, const char *spec) {
+    return scheduler_set_weights(&context->scheduler, spec);
+}
+
+int http2coap_add_priority_rule(http2coap_context_t *context, const char *spec) {
+    return scheduler_add_rule(&context->scheduler, spec);
+}
+
+int http2coap_add_multicast_route(http2coap_context_t *context, const char *spec) {
+    return multicast_add_route(&context->multicast, spec);
+}
+
+// Returns 0 when the address is a replica now or already was, -1 when there is no room left
+static int add_replica_address(http2coap_context_t *context, const struct sockaddr_in *address) {
+    for(unsigned int i = 0; i < context->replica_count; i++) {
+        if(context->replicas[i].sin_addr.s_addr == address->sin_addr.s_addr)
+            return 0;
+    }
+    if(context->replica_count == HTTP2COAP_MAX_REPLICAS)
+        return -1;
+    context->replicas[context->replica_count++] = *address;
+    return 0;
+}
+
+int http2coap_add_replica(http2coap_context_t *context, const char *host) {
+    if(context->replica_count == HTTP2COAP_MAX_REPLICAS) {
+        fprintf(stderr, "error: too many replicas (max %d)\n", HTTP2COAP_MAX_REPLICAS);
+        return -1;
+    }
+    // Every address of the host is a replica of its own
+    struct sockaddr_in addresses[HTTP2COAP_MAX_REPLICAS];
+    str replica_host = { strlen(host), (unsigned char *)host };
+    int count = resolve_address(&replica_host, addresses, HTTP2COAP_MAX_REPLICAS);
+    if(count < 0)
+        return -1;
+    for(int i = 0; i < count && add_replica_address(context, &addresses[i]) == 0; i++)
+        ;
+    return 0;
+}
+
+int http2coap_start(http2coap_context_t *context) {
+    http2coap_config_t *config = &context->config;
+    if(config->coap_host == NULL) {
+        fprintf(stderr, "error: no CoAP host to forward requests to\n");
+        return -1;
+    }
+    if(config->max_in_flight == 0 || config->max_in_flight > HTTP2COAP_MAX_IN_FLIGHT) {
+        fprintf(stderr, "error: invalid number of exchanges in flight: %u (1 to %d)\n", config->max_in_flight,
+                HTTP2COAP_MAX_IN_FLIGHT);
+        return -1;
+    }
+    if(config->request_timeout_max_ms == 0 || config->request_timeout_max_ms > HTTP2COAP_MAX_TIMEOUT_MS
+       || config->multicast_window_ms == 0 || config->multicast_window_ms > HTTP2COAP_MAX_TIMEOUT_MS) {
+        fprintf(stderr, "error: invalid request timeout or multicast window (1 to %u ms)\n", HTTP2COAP_MAX_TIMEOUT_MS);
+        return -1;
+    }
+    if(config->hedge_percentile > 99 || config->hedge_max_percent > 100) {
+        fprintf(stderr, "error: invalid hedging: %u%% of the requests after the %uth percentile\n",
+                config->hedge_max_percent, config->hedge_percentile);
+        return -1;
+    }
+
+    // The first address of the upstream is the primary, the others are as good as replicas.
+    // A replica that is the primary itself would hedge to the node that is already slow.
+    struct sockaddr_in addresses[1 + HTTP2COAP_MAX_REPLICAS];
+    str host = { strlen(config->coap_host), (unsigned char *)config->coap_host };
+    int count = resolve_address(&host, addresses, 1 + HTTP2COAP_MAX_REPLICAS);
+    if(count < 0)
+        return -1;
+    context->destination = addresses[0];
+    context->destination.sin_port = htons(config->coap_port);
+    unsigned int kept = 0;
+    for(unsigned int i = 0; i < context->replica_count; i++) {
+        if(context->replicas[i].sin_addr.s_addr != context->destination.sin_addr.s_addr)
+            context->replicas[kept++] = context->replicas[i];
+    }
+    context->replica_count = kept;
+    for(int i = 1; i < count && add_replica_address(context, &addresses[i]) == 0; i++)
+        ;
+    for(unsigned int i = 0; i < context->replica_count; i++)
+        context->replicas[i].sin_port = htons(config->coap_port);
+
+    // Only used by the CoAP thread from now on
+    context->coap_context = coap_create_context("0.0.0.0", NULL);
+    if(context->coap_context == NULL)
+        return -1;
+    if(coap_client_start(context) != 0) {
+        coap_free_context(context->coap_context);
+        context->coap_context = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void http2coap_stop(http2coap_context_t *context) {
+    coap_client_stop(context);
+    if(context->coap_context) {
+        coap_free_context(context->coap_context);
+        context->coap_context = NULL;
+    }
+}
+
+void http2coap_free(http2coap_context_t *context) {
+    if(context == NULL)
+        return;
+    http2coap_stop(context);
+    hedge_destroy(&context->hedge);
+    coap_io_destroy(&context->io);
+    resource_directory_destroy(&context->resource_directory);
+    scheduler_destroy(&context->scheduler);
+    free(context);
+}
+
+http2coap_request_t *http2coap_request_new(http2coap_context_t *context, const char *uri) {
+    exchange_t *exchange = exchange_new(context);
+    if(exchange != NULL && trace_sampled())
+        exchange->trace = trace_start(&exchange->arena, uri);
+    return exchange;
+}
+
+// Turn the path of the URL into Uri-Path options allocated in the arena of the exchange
+static int add_uri_path_options(exchange_t *exchange, const char *path) {
+    if(strlen(path) > 1) {
+        // Each segment gets at most a 3 bytes option header
+        size_t buflen = 3 * strlen(path);
+        unsigned char *buf = arena_alloc(&exchange->arena, buflen);
+        if(buf == NULL)
+            return -1;
+        int res = coap_split_query((const unsigned char *)path + 1, strlen(path) - 1, buf, &buflen);
+
+        while(res--) {
+            coap_insert(&exchange->options, new_option_node_from(&exchange->arena, COAP_OPTION_URI_PATH,
+                                                                 COAP_OPT_LENGTH(buf), COAP_OPT_VALUE(buf)));
+            buf += COAP_OPT_SIZE(buf);
+        }
+    }
+    return 0;
+}
+
+static const char *find_header(const http2coap_request_info_t *info, const char *name) {
+    for(size_t i = 0; i < info->header_count; i++) {
+        if(strcasecmp(info->headers[i].name, name) == 0)
+            return info->headers[i].value;
+    }
+    return NULL;
+}
+
+// The deadline covers queueing and retransmissions, clients can only make it shorter
+static void set_deadline(exchange_t *exchange, const char *header) {
+    unsigned int timeout_ms = exchange->context->config.request_timeout_max_ms;
+
+    if(header != NULL) {
+        char *endptr;
+        double seconds = strtod(header, &endptr);
+        if(endptr != header && *endptr == '\0' && seconds > 0 && seconds * 1000 < timeout_ms)
+            timeout_ms = (unsigned int)(seconds * 1000);
+    }
+
+    coap_ticks(&exchange->deadline);
+    exchange->deadline += (coap_tick_t)((uint64_t)timeout_ms * COAP_TICKS_PER_SECOND / 1000);
+}
+
+unsigned int http2coap_request_prepare(http2coap_request_t *request, const http2coap_request_info_t *info) {
+    exchange_t *exchange = request;
+    http2coap_context_t *context = exchange->context;
+
+    // Define Method
+    method_t coap_method;
+    if(strcmp("GET", info->method) == 0) {
+        coap_method = COAP_REQUEST_GET;
+    }
+    else if(strcmp("POST", info->method) == 0) {
+        coap_method = COAP_REQUEST_POST;
+    }
+    else if(strcmp("PUT", info->method) == 0) {
+        coap_method = COAP_REQUEST_PUT;
+    }
+    else if(strcmp("DELETE", info->method) == 0) {
+        coap_method = COAP_REQUEST_DELETE;
+    }
+    else {
+        return HTTP_NOT_ACCEPTABLE;
+    }
+
+    // Fan-out routes only forward what follows their prefix
+    const char *path = info->path;
+    const multicast_route_t *multicast_route = multicast_route_for(&context->multicast, info->path, &path);
+
+    // Paths the device does not have are answered here, without a round-trip.
+    // A PUT may create the resource, so it always goes through and invalidates what we remember.
+    if(coap_method == COAP_REQUEST_PUT)
+        resource_directory_forget_missing(context, info->path);
+    else if(multicast_route == NULL && resource_directory_is_missing(context, coap_method, info->path))
+        return HTTP_NOT_FOUND;
+
+    // Everything from here on is allocated in the arena of the exchange
+    size_t url_length = strlen(info->path) + 1;
+    char *url_copy = arena_alloc(&exchange->arena, url_length);
+    if(url_copy == NULL)
+        return HTTP_INTERNAL_SERVER_ERROR;
+    exchange->url = memcpy(url_copy, info->path, url_length);
+
+    exchange->multicast_route = multicast_route;
+
+    // Add URI if any
+    if(add_uri_path_options(exchange, path) != 0)
+        return HTTP_INTERNAL_SERVER_ERROR;
+
+    // The body becomes the CoAP payload
+    if(info->body_length != 0) {
+        exchange->payload = arena_alloc(&exchange->arena, info->body_length);
+        if(exchange->payload == NULL)
+            return HTTP_INTERNAL_SERVER_ERROR;
+        memcpy(exchange->payload, info->body, info->body_length);
+        exchange->payload_length = info->body_length;
+    }
+
+    exchange->method = coap_method;
+    exchange->priority = scheduler_classify(&context->scheduler, find_header(info, HTTP2COAP_PRIORITY_HEADER),
+                                            info->method, info->path);
+    set_deadline(exchange, find_header(info, HTTP2COAP_TIMEOUT_HEADER));
+    exchange->client_fd = info->client_fd;
+    TRACE_EVENT(exchange, "request_received");
+    return 0;
+}
+
+void http2coap_request_submit(http2coap_request_t *request, http2coap_callback_t callback, void *arg) {
+    request->callback = callback;
+    request->callback_arg = arg;
+    // Nothing would ever pick it up once the core is stopped
+    if(!request->context->coap_thread_running) {
+        exchange_cancel(request);
+        return;
+    }
+    scheduler_submit(request);
+}
+
+ssize_t http2coap_read_body(http2coap_request_t *request, char *buf, size_t max) {
+    return multicast_read_body(request, buf, max);
+}
+
+void http2coap_request_release(http2coap_request_t *request, const char *event) {
+    // Requests that are queued or in flight are cancelled and freed by the CoAP thread
+    if(exchange_abandon(request)) {
+        if(event != NULL)
+            TRACE_EVENT(request, event);
+        exchange_free(request);
+    }
+}
+
+void http2coap_request_trace(http2coap_request_t *request, const char *event) {
+    TRACE_EVENT(request, event);
+}
+
+const char *http2coap_request_trace_id(const http2coap_request_t *request) {
+    return request->trace != NULL ? request->trace->id : NULL;
+}
+
+int http2coap_trace_open(const char *path, double sample_rate) {
+    if(trace_open(path) != 0)
+        return -1;
+    trace_sample_rate = sample_rate;
+    return 0;
+}
+
+void http2coap_trace_close(void) {
+    trace_sample_rate = 0;
+    trace_close();
+}
+
+size_t http2coap_scheduler_stats(http2coap_context_t *context, char *buf, size_t size) {
+    return scheduler_format_stats(&context->scheduler, buf, size);
+}
+
+size_t http2coap_io_stats(http2coap_context_t *context, char *buf, size_t size) {
+    return coap_io_format_stats(&context->io, buf, size);
+}
+
+size_t http2coap_hedge_stats(http2coap_context_t *context, char *buf, size_t size) {
+    return hedge_format_stats(&context->hedge, buf, size);
+}
+
+size_t http2coap_directory_json(http2coap_context_t *context, char **json) {
+    return resource_directory_format_json(context, json);
+}
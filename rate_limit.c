@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include "rate_limit.h"
+
+typedef struct {
+    float rate;     // tokens per second, 0 means no limit
+    float burst;    // bucket capacity
+} token_bucket_config_t;
+
+// One client bucket is 24 bytes, the whole table stays small enough to live in cache
+typedef struct {
+    uint8_t addr[16];   // IPv4 addresses are stored v4-mapped
+    uint32_t last_ms;   // last refill, 0 means the slot was never used
+    float tokens;
+} client_bucket_t;
+
+#define CLIENT_TABLE_SIZE 4096          /* must be a power of two */
+#define CLIENT_TABLE_STRIPES 64         /* one lock per group of CLIENT_TABLE_SIZE / CLIENT_TABLE_STRIPES slots */
+#define CLIENT_TABLE_PROBES 8           /* probes never cross a stripe boundary */
+
+static token_bucket_config_t client_limit = { 0, 0 };
+static client_bucket_t client_table[CLIENT_TABLE_SIZE];
+static pthread_mutex_t client_locks[CLIENT_TABLE_STRIPES];
+static pthread_once_t client_locks_once = PTHREAD_ONCE_INIT;
+
+typedef struct {
+    char prefix[64];
+    token_bucket_config_t limit;
+    float tokens;
+    uint32_t last_ms;
+    pthread_mutex_t lock;
+} route_limit_t;
+
+#define MAX_ROUTE_LIMITS 16
+static route_limit_t route_limits[MAX_ROUTE_LIMITS];
+static int route_limits_count = 0;
+
+static void init_client_locks(void) {
+    for(int i = 0; i < CLIENT_TABLE_STRIPES; i++)
+        pthread_mutex_init(&client_locks[i], NULL);
+}
+
+// Milliseconds on the monotonic clock, never 0 so that 0 can mark unused slots
+static uint32_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint32_t ms = (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+    return ms ? ms : 1;
+}
+
+static int parse_bucket_config(const char *spec, token_bucket_config_t *config) {
+    char *endptr;
+    config->rate = strtof(spec, &endptr);
+    if(endptr == spec || config->rate <= 0)
+        return -1;
+    if(*endptr == '/') {
+        const char *burst = endptr + 1;
+        config->burst = strtof(burst, &endptr);
+        if(endptr == burst || config->burst < 1)
+            return -1;
+    }
+    else {
+        config->burst = config->rate < 1 ? 1 : config->rate;
+    }
+    return *endptr == '\0' ? 0 : -1;
+}
+
+int rate_limit_set_client(const char *spec) {
+    pthread_once(&client_locks_once, init_client_locks);
+    return parse_bucket_config(spec, &client_limit);
+}
+
+int rate_limit_add_route(const char *spec) {
+    const char *equal = strchr(spec, '=');
+    if(spec[0] != '/' || equal == NULL || (size_t)(equal - spec) >= sizeof(route_limits[0].prefix))
+        return -1;
+    if(route_limits_count == MAX_ROUTE_LIMITS) {
+        fprintf(stderr, "error: too many route rate limits (max %d)\n", MAX_ROUTE_LIMITS);
+        return -1;
+    }
+
+    route_limit_t *route = &route_limits[route_limits_count];
+    memset(route, 0, sizeof(*route));
+    memcpy(route->prefix, spec, equal - spec);
+    if(parse_bucket_config(equal + 1, &route->limit) != 0)
+        return -1;
+    route->tokens = route->limit.burst;
+    pthread_mutex_init(&route->lock, NULL);
+    route_limits_count++;
+    return 0;
+}
+
+// Refills the bucket, returns 0 when it holds a token or the seconds until it will
+static unsigned int refill_bucket(const token_bucket_config_t *limit, float *tokens, uint32_t *last_ms, uint32_t now) {
+    float elapsed = (float)(uint32_t)(now - *last_ms) / 1000.0f;
+    *tokens = fminf(limit->burst, *tokens + elapsed * limit->rate);
+    *last_ms = now;
+    if(*tokens >= 1.0f)
+        return 0;
+    unsigned int retry_after = (unsigned int)ceilf((1.0f - *tokens) / limit->rate);
+    return retry_after ? retry_after : 1;
+}
+
+static void client_key(const struct sockaddr *client_addr, uint8_t key[16]) {
+    memset(key, 0, 16);
+    if(client_addr->sa_family == AF_INET6) {
+        memcpy(key, &((const struct sockaddr_in6 *)client_addr)->sin6_addr, 16);
+    }
+    else if(client_addr->sa_family == AF_INET) {
+        key[10] = key[11] = 0xff;
+        memcpy(key + 12, &((const struct sockaddr_in *)client_addr)->sin_addr, 4);
+    }
+}
+
+static uint32_t hash_key(const uint8_t key[16]) {
+    uint32_t h = 2166136261u; /* FNV-1a */
+    for(int i = 0; i < 16; i++) {
+        h ^= key[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Returns the bucket of the client with the lock of its stripe held
+static client_bucket_t *lock_client_bucket(const struct sockaddr *client_addr, uint32_t now, pthread_mutex_t **lock) {
+    uint8_t key[16];
+    client_key(client_addr, key);
+
+    uint32_t h = hash_key(key);
+    unsigned int stripe_slots = CLIENT_TABLE_SIZE / CLIENT_TABLE_STRIPES;
+    unsigned int stripe = h % CLIENT_TABLE_STRIPES;
+    unsigned int base = stripe * stripe_slots;
+    unsigned int start = (h / CLIENT_TABLE_STRIPES) % stripe_slots;
+    // A client that has been idle long enough to refill its bucket is indistinguishable from a new one,
+    // so its slot can be reused without changing anyone's limit. Ages are compared modulo 2^32 ms, so a
+    // tiny rate caps at half of that.
+    float idle = client_limit.burst / client_limit.rate * 1000.0f + 1000.0f;
+    uint32_t idle_ms = idle < (float)INT32_MAX ? (uint32_t)idle : (uint32_t)INT32_MAX;
+
+    *lock = &client_locks[stripe];
+    pthread_mutex_lock(*lock);
+    client_bucket_t *reusable = NULL, *oldest = NULL;
+    for(unsigned int i = 0; i < CLIENT_TABLE_PROBES; i++) {
+        client_bucket_t *slot = &client_table[base + (start + i) % stripe_slots];
+        if(slot->last_ms != 0 && memcmp(slot->addr, key, 16) == 0)
+            return slot;
+        if(slot->last_ms == 0 || (uint32_t)(now - slot->last_ms) > idle_ms) {
+            if(reusable == NULL)
+                reusable = slot;
+        }
+        else if(oldest == NULL || (int32_t)(slot->last_ms - oldest->last_ms) < 0) {
+            oldest = slot;
+        }
+    }
+    // With every probed slot busy, the least recently refilled client makes room: a client we have never
+    // seen is not turned away because of the others sharing its stripe
+    client_bucket_t *bucket = reusable != NULL ? reusable : oldest;
+
+    // New client (or its entry aged out): start from a full bucket
+    memcpy(bucket->addr, key, 16);
+    bucket->tokens = client_limit.burst;
+    bucket->last_ms = now;
+    return bucket;
+}
+
+// A prefix only covers whole path segments: /a covers /a and /a/b but not /ab
+static route_limit_t *find_route(const char *url) {
+    for(int i = 0; i < route_limits_count; i++) {
+        route_limit_t *route = &route_limits[i];
+        size_t length = strlen(route->prefix);
+        if(strncmp(url, route->prefix, length) == 0
+           && (url[length] == '\0' || url[length] == '/' || route->prefix[length - 1] == '/'))
+            return route;
+    }
+    return NULL;
+}
+
+unsigned int rate_limit_check(const struct sockaddr *client_addr, const char *url) {
+    if(client_limit.rate == 0 && route_limits_count == 0)
+        return 0;
+
+    uint32_t now = now_ms();
+    unsigned int retry_after = 0;
+    client_bucket_t *client = NULL;
+    pthread_mutex_t *client_lock = NULL;
+    if(client_limit.rate > 0 && client_addr != NULL) {
+        client = lock_client_bucket(client_addr, now, &client_lock);
+        retry_after = refill_bucket(&client_limit, &client->tokens, &client->last_ms, now);
+    }
+
+    // Always locked after the client stripe, never before
+    route_limit_t *route = find_route(url);
+    if(route != NULL) {
+        pthread_mutex_lock(&route->lock);
+        if(route->last_ms == 0)
+            route->last_ms = now;
+        unsigned int route_retry_after = refill_bucket(&route->limit, &route->tokens, &route->last_ms, now);
+        if(route_retry_after > retry_after)
+            retry_after = route_retry_after;
+    }
+
+    // Tokens are only taken when both buckets have one, a request refused by one limit costs nothing to the other
+    if(retry_after == 0) {
+        if(client != NULL)
+            client->tokens -= 1.0f;
+        if(route != NULL)
+            route->tokens -= 1.0f;
+    }
+
+    if(route != NULL)
+        pthread_mutex_unlock(&route->lock);
+    if(client != NULL)
+        pthread_mutex_unlock(client_lock);
+    return retry_after;
+}
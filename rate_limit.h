@@ -0,0 +1,15 @@
+#ifndef HTTP2COAP_RATE_LIMIT_H
+#define HTTP2COAP_RATE_LIMIT_H
+
+#include <sys/socket.h>
+
+// Token bucket limits applied to incoming HTTP requests before they reach the CoAP side.
+// A spec is "rate[/burst]" where rate is in requests per second and burst defaults to rate.
+int rate_limit_set_client(const char *spec);
+// A route spec is "/prefix=rate[/burst]", one bucket is shared by every client hitting the prefix
+int rate_limit_add_route(const char *spec);
+
+// Returns 0 when the request may proceed, otherwise the number of seconds to put in Retry-After
+unsigned int rate_limit_check(const struct sockaddr *client_addr, const char *url);
+
+#endif //HTTP2COAP_RATE_LIMIT_H
@@ -0,0 +1,389 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include "resource_directory.h"
+#include "context.h"
+#include "exchange.h"
+#include "scheduler.h"
+
+typedef struct {
+    const char *path;
+    const char *attributes;     // link-format parameters, e.g. ;rt="temperature";if="sensor"
+} resource_t;
+
+// Parsed /.well-known/core of one upstream, the strings point into text
+typedef struct resource_index_t {
+    char *text;
+    resource_t *resources;
+    size_t count;
+    coap_tick_t fetched_at;
+} resource_index_t;
+
+static int compare_resources(const void *a, const void *b) {
+    return strcmp(((const resource_t *)a)->path, ((const resource_t *)b)->path);
+}
+
+static void free_index(resource_index_t *index) {
+    if(index == NULL)
+        return;
+    free(index->resources);
+    free(index->text);
+    free(index);
+}
+
+void resource_directory_init(resource_directory_t *directory) {
+    memset(directory, 0, sizeof(resource_directory_t));
+    pthread_rwlock_init(&directory->index_lock, NULL);
+    pthread_mutex_init(&directory->negative_cache_lock, NULL);
+}
+
+void resource_directory_destroy(resource_directory_t *directory) {
+    free(directory->fetch_buffer);
+    directory->fetch_buffer = NULL;
+    free_index(directory->current_index);
+    directory->current_index = NULL;
+    pthread_rwlock_destroy(&directory->index_lock);
+    pthread_mutex_destroy(&directory->negative_cache_lock);
+}
+
+// Parse link-format (RFC 6690): </path>;attr=value;attr="quoted, value",</other>...
+static resource_index_t *parse_link_format(const unsigned char *data, size_t length) {
+    resource_index_t *index = calloc(1, sizeof(resource_index_t));
+    if(index == NULL)
+        return NULL;
+    index->text = malloc(length + 1);
+    if(index->text == NULL) {
+        free(index);
+        return NULL;
+    }
+    memcpy(index->text, data, length);
+    index->text[length] = '\0';
+
+    size_t capacity = 0;
+    char *s = index->text;
+    while(*s != '\0') {
+        while(*s == ',' || *s == ' ' || *s == '\n' || *s == '\r')
+            s++;
+        if(*s != '<')
+            break;
+        char *path = ++s;
+        char *end = strchr(s, '>');
+        if(end == NULL)
+            break;
+        *end = '\0';
+        s = end + 1;
+
+        // The attributes run until the next comma that is not inside quotes
+        char *attributes = s;
+        int quoted = 0;
+        while(*s != '\0' && (quoted || *s != ',')) {
+            if(*s == '"')
+                quoted = !quoted;
+            s++;
+        }
+        if(*s == ',')
+            *s++ = '\0';
+
+        if(index->count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            resource_t *resources = realloc(index->resources, capacity * sizeof(resource_t));
+            if(resources == NULL) {
+                free_index(index);
+                return NULL;
+            }
+            index->resources = resources;
+        }
+        index->resources[index->count].path = path;
+        index->resources[index->count].attributes = attributes;
+        index->count++;
+    }
+
+    qsort(index->resources, index->count, sizeof(resource_t), compare_resources);
+    return index;
+}
+
+// A directory bigger than this is not indexed at all, rather than indexed in part
+#define MAX_DIRECTORY_SIZE 65536
+
+static void fetch_block(http2coap_context_t *context, unsigned int num, unsigned int szx);
+
+static void drop_fetch(resource_directory_t *directory) {
+    free(directory->fetch_buffer);
+    directory->fetch_buffer = NULL;
+    directory->fetch_length = 0;
+    directory->fetch_pending = 0;
+}
+
+// received is NULL when the fetch failed or timed out, the current index is kept then
+static void well_known_core_received(exchange_t *exchange, coap_pdu_t *received) {
+    http2coap_context_t *context = exchange->context;
+    resource_directory_t *directory = &context->resource_directory;
+    size_t length = 0;
+    unsigned char *data = NULL;
+
+    if(received == NULL) {
+        drop_fetch(directory);
+        return;
+    }
+    if(received->hdr->code != COAP_RESPONSE_CODE(205) || !coap_get_data(received, &length, &data)) {
+        fprintf(stderr, "resource directory: cannot read /.well-known/core (%u.%02u)\n",
+                received->hdr->code >> 5, received->hdr->code & 0x1f);
+        drop_fetch(directory);
+        return;
+    }
+
+    // A block-wise answer (RFC 7959) is only indexed once every block is in, a partial index would answer
+    // 404 for the resources listed in the missing blocks
+    coap_block_t block = { 0, 0, 0 };
+    int block_wise = coap_get_block(received, COAP_OPTION_BLOCK2, &block);
+    if(block_wise && ((size_t)block.num << (block.szx + 4)) != directory->fetch_length) {
+        fprintf(stderr, "resource directory: unexpected block %u of /.well-known/core\n", (unsigned int)block.num);
+        drop_fetch(directory);
+        return;
+    }
+    if(directory->fetch_length + length > MAX_DIRECTORY_SIZE) {
+        fprintf(stderr, "resource directory: /.well-known/core is larger than %d bytes\n", MAX_DIRECTORY_SIZE);
+        drop_fetch(directory);
+        return;
+    }
+    unsigned char *buffer = realloc(directory->fetch_buffer, directory->fetch_length + length);
+    if(buffer == NULL && directory->fetch_length + length != 0) {
+        fprintf(stderr, "resource directory: out of memory\n");
+        drop_fetch(directory);
+        return;
+    }
+    directory->fetch_buffer = buffer;
+    memcpy(directory->fetch_buffer + directory->fetch_length, data, length);
+    directory->fetch_length += length;
+
+    if(block_wise && block.m) {
+        fetch_block(context, block.num + 1, block.szx);
+        return;
+    }
+
+    resource_index_t *index = parse_link_format(directory->fetch_buffer, directory->fetch_length);
+    drop_fetch(directory);
+    if(index == NULL) {
+        fprintf(stderr, "resource directory: out of memory\n");
+        return;
+    }
+    coap_ticks(&index->fetched_at);
+    fprintf(stderr, "resource directory: %zu resources on the upstream\n", index->count);
+
+    pthread_rwlock_wrlock(&directory->index_lock);
+    resource_index_t *old_index = directory->current_index;
+    directory->current_index = index;
+    pthread_rwlock_unlock(&directory->index_lock);
+    free_index(old_index);
+}
+
+// Fetched through the scheduler like any request, but never ahead of real clients
+static void fetch_block(http2coap_context_t *context, unsigned int num, unsigned int szx) {
+    resource_directory_t *directory = &context->resource_directory;
+    exchange_t *exchange = exchange_new(context);
+    if(exchange == NULL) {
+        drop_fetch(directory);
+        return;
+    }
+
+    static unsigned char well_known[] = ".well-known", core[] = "core";
+    coap_insert(&exchange->options, new_option_node_from(&exchange->arena, COAP_OPTION_URI_PATH,
+                                                         sizeof(well_known) - 1, well_known));
+    coap_insert(&exchange->options, new_option_node_from(&exchange->arena, COAP_OPTION_URI_PATH,
+                                                         sizeof(core) - 1, core));
+    if(num != 0) {
+        unsigned char value[4];
+        unsigned int value_length = coap_encode_var_bytes(value, (num << 4) | szx);
+        coap_insert(&exchange->options, new_option_node_from(&exchange->arena, COAP_OPTION_BLOCK2,
+                                                             value_length, value));
+    }
+    exchange->method = COAP_REQUEST_GET;
+    exchange->priority = PRIORITY_BULK;
+    exchange->coap_handler = well_known_core_received;
+    directory->fetch_pending = 1;
+    scheduler_submit(exchange);
+}
+
+coap_tick_t resource_directory_refresh(http2coap_context_t *context, coap_tick_t now, coap_tick_t max_wait) {
+    resource_directory_t *directory = &context->resource_directory;
+    unsigned int refresh_seconds = context->config.resource_directory_refresh_seconds;
+    if(refresh_seconds == 0)
+        return max_wait;
+
+    if(!directory->fetch_pending && directory->next_refresh <= now) {
+        directory->next_refresh = now + (coap_tick_t)refresh_seconds * COAP_TICKS_PER_SECOND;
+        fetch_block(context, 0, 0);
+    }
+
+    coap_tick_t wait = directory->next_refresh > now ? directory->next_refresh - now : 0;
+    return wait < max_wait ? wait : max_wait;
+}
+
+static uint64_t hash_path(method_t method, const char *path) {
+    uint64_t h = 14695981039346656037ull; /* FNV-1a */
+    h ^= method;
+    h *= 1099511628211ull;
+    for(; *path != '\0'; path++) {
+        h ^= (unsigned char)*path;
+        h *= 1099511628211ull;
+    }
+    return h ? h : 1;
+}
+
+static int is_negatively_cached(http2coap_context_t *context, method_t method, const char *path) {
+    resource_directory_t *directory = &context->resource_directory;
+    if(context->config.negative_cache_ttl_seconds == 0)
+        return 0;
+
+    uint64_t hash = hash_path(method, path);
+    coap_tick_t now;
+    coap_ticks(&now);
+
+    pthread_mutex_lock(&directory->negative_cache_lock);
+    negative_entry_t *entry = &directory->negative_cache[hash & (NEGATIVE_CACHE_SIZE - 1)];
+    int missing = entry->hash == hash && entry->expires > now;
+    pthread_mutex_unlock(&directory->negative_cache_lock);
+    return missing;
+}
+
+void resource_directory_remember_missing(http2coap_context_t *context, method_t method, const char *path) {
+    resource_directory_t *directory = &context->resource_directory;
+    unsigned int ttl_seconds = context->config.negative_cache_ttl_seconds;
+    if(ttl_seconds == 0 || path == NULL)
+        return;
+
+    uint64_t hash = hash_path(method, path);
+    coap_tick_t now;
+    coap_ticks(&now);
+
+    pthread_mutex_lock(&directory->negative_cache_lock);
+    negative_entry_t *entry = &directory->negative_cache[hash & (NEGATIVE_CACHE_SIZE - 1)];
+    entry->hash = hash;
+    entry->expires = now + (coap_tick_t)ttl_seconds * COAP_TICKS_PER_SECOND;
+    pthread_mutex_unlock(&directory->negative_cache_lock);
+}
+
+void resource_directory_forget_missing(http2coap_context_t *context, const char *path) {
+    resource_directory_t *directory = &context->resource_directory;
+    if(context->config.negative_cache_ttl_seconds == 0)
+        return;
+
+    pthread_mutex_lock(&directory->negative_cache_lock);
+    for(method_t method = COAP_REQUEST_GET; method <= COAP_REQUEST_DELETE; method++) {
+        uint64_t hash = hash_path(method, path);
+        negative_entry_t *entry = &directory->negative_cache[hash & (NEGATIVE_CACHE_SIZE - 1)];
+        if(entry->hash == hash)
+            entry->hash = 0;
+    }
+    pthread_mutex_unlock(&directory->negative_cache_lock);
+}
+
+int resource_directory_is_missing(http2coap_context_t *context, method_t method, const char *path) {
+    resource_directory_t *directory = &context->resource_directory;
+
+    // The directory itself is always asked for
+    if(strncmp(path, "/.well-known/", 13) == 0)
+        return 0;
+
+    if(is_negatively_cached(context, method, path))
+        return 1;
+
+    int missing = 0;
+    pthread_rwlock_rdlock(&directory->index_lock);
+    resource_index_t *index = directory->current_index;
+    if(index != NULL) {
+        resource_t key = { path, NULL };
+        missing = bsearch(&key, index->resources, index->count, sizeof(resource_t), compare_resources) == NULL;
+    }
+    pthread_rwlock_unlock(&directory->index_lock);
+    return missing;
+}
+
+// Appends s to the buffer as the contents of a JSON string
+static void append_json_string(char **buf, size_t *length, size_t *capacity, const char *s) {
+    size_t needed = *length + 6 * strlen(s) + 1;
+    if(needed > *capacity) {
+        size_t new_capacity = *capacity * 2 > needed ? *capacity * 2 : needed;
+        char *new_buf = realloc(*buf, new_capacity);
+        if(new_buf == NULL)
+            return;
+        *buf = new_buf;
+        *capacity = new_capacity;
+    }
+    for(; *s != '\0'; s++) {
+        unsigned char c = (unsigned char)*s;
+        if(c == '"' || c == '\\') {
+            (*buf)[(*length)++] = '\\';
+            (*buf)[(*length)++] = (char)c;
+        }
+        else if(c < 0x20) {
+            *length += snprintf(*buf + *length, *capacity - *length, "\\u%04x", c);
+        }
+        else {
+            (*buf)[(*length)++] = (char)c;
+        }
+    }
+    (*buf)[*length] = '\0';
+}
+
+static void append_text(char **buf, size_t *length, size_t *capacity, const char *s) {
+    size_t s_length = strlen(s);
+    if(*length + s_length + 1 > *capacity) {
+        size_t new_capacity = *capacity * 2 > *length + s_length + 1 ? *capacity * 2 : *length + s_length + 1;
+        char *new_buf = realloc(*buf, new_capacity);
+        if(new_buf == NULL)
+            return;
+        *buf = new_buf;
+        *capacity = new_capacity;
+    }
+    memcpy(*buf + *length, s, s_length + 1);
+    *length += s_length;
+}
+
+size_t resource_directory_format_json(http2coap_context_t *context, char **json) {
+    resource_directory_t *directory = &context->resource_directory;
+    size_t length = 0, capacity = 1024;
+    char *buf = malloc(capacity);
+    if(buf == NULL) {
+        *json = NULL;
+        return 0;
+    }
+    buf[0] = '\0';
+
+    char upstream[64];
+    snprintf(upstream, sizeof(upstream), "%s:%u", inet_ntoa(context->destination.sin_addr),
+             ntohs(context->destination.sin_port));
+
+    append_text(&buf, &length, &capacity, "{\"upstreams\":[{\"address\":\"");
+    append_json_string(&buf, &length, &capacity, upstream);
+    append_text(&buf, &length, &capacity, "\"");
+
+    pthread_rwlock_rdlock(&directory->index_lock);
+    const resource_index_t *index = directory->current_index;
+    if(index != NULL) {
+        coap_tick_t now;
+        coap_ticks(&now);
+        char age[48];
+        snprintf(age, sizeof(age), ",\"age_seconds\":%lu",
+                 (unsigned long)((now - index->fetched_at) / COAP_TICKS_PER_SECOND));
+        append_text(&buf, &length, &capacity, age);
+    }
+    append_text(&buf, &length, &capacity, ",\"resources\":[");
+    if(index != NULL) {
+        for(size_t i = 0; i < index->count; i++) {
+            append_text(&buf, &length, &capacity, i ? ",{\"path\":\"" : "{\"path\":\"");
+            append_json_string(&buf, &length, &capacity, index->resources[i].path);
+            append_text(&buf, &length, &capacity, "\",\"attributes\":\"");
+            append_json_string(&buf, &length, &capacity, index->resources[i].attributes);
+            append_text(&buf, &length, &capacity, "\"}");
+        }
+    }
+    pthread_rwlock_unlock(&directory->index_lock);
+
+    append_text(&buf, &length, &capacity, "]}]}\n");
+    *json = buf;
+    return length;
+}
@@ -0,0 +1,49 @@
+#ifndef HTTP2COAP_RESOURCE_DIRECTORY_H
+#define HTTP2COAP_RESOURCE_DIRECTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <coap/coap.h>
+#include "http2coap.h"
+#include "coap_client.h"
+
+typedef struct {
+    uint64_t hash;
+    coap_tick_t expires;
+} negative_entry_t;
+
+#define NEGATIVE_CACHE_SIZE 256 /* must be a power of two */
+
+// What a context knows about the resources of its upstream. How often the directory is refreshed and how long
+// negative answers are kept comes from the configuration of the context.
+typedef struct {
+    pthread_rwlock_t index_lock;
+    struct resource_index_t *current_index;
+    coap_tick_t next_refresh;
+    int fetch_pending;                  // only touched by the CoAP thread, like the fetch buffer
+    unsigned char *fetch_buffer;        // the blocks of a block-wise answer received so far
+    size_t fetch_length;
+
+    pthread_mutex_t negative_cache_lock;
+    negative_entry_t negative_cache[NEGATIVE_CACHE_SIZE];
+} resource_directory_t;
+
+void resource_directory_init(resource_directory_t *directory);
+void resource_directory_destroy(resource_directory_t *directory);
+
+// Returns 1 when path is known not to exist on the upstream, so that we can answer 404 ourselves.
+// Negative answers are remembered per method: a resource may answer 4.04 to a GET and still accept a POST.
+int resource_directory_is_missing(http2coap_context_t *context, method_t method, const char *path);
+// Remember that the upstream answered 4.04 to method on path
+void resource_directory_remember_missing(http2coap_context_t *context, method_t method, const char *path);
+// Forget the negative answers for path, whatever the method, because a request may have created the resource
+void resource_directory_forget_missing(http2coap_context_t *context, const char *path);
+
+// Called by the CoAP thread, queues a fetch when one is due and returns the ticks until the next one
+coap_tick_t resource_directory_refresh(http2coap_context_t *context, coap_tick_t now, coap_tick_t max_wait);
+
+// Writes the merged directory as JSON into a malloc'd buffer, returns its length
+size_t resource_directory_format_json(http2coap_context_t *context, char **json);
+
+#endif //HTTP2COAP_RESOURCE_DIRECTORY_H
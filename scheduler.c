@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include "scheduler.h"
+#include "context.h"
+#include "coap_client.h"
+
+const char *priority_class_names[PRIORITY_CLASSES] = { "high", "normal", "bulk" };
+static const unsigned int default_weights[PRIORITY_CLASSES] = { 8, 4, 1 };
+
+#define MAX_WEIGHT 840
+
+static uint64_t gcd(uint64_t a, uint64_t b) {
+    while(b != 0) {
+        uint64_t r = a % b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+// An exchange costs cost / weight of virtual time, cost is the least common multiple of the weights so that
+// the division is always exact
+static void set_weights(scheduler_t *scheduler, const unsigned int weights[PRIORITY_CLASSES]) {
+    uint64_t cost = 1;
+    for(int i = 0; i < PRIORITY_CLASSES; i++) {
+        scheduler->weights[i] = weights[i];
+        cost = cost / gcd(cost, weights[i]) * weights[i];
+    }
+    scheduler->cost = cost;
+}
+
+void scheduler_init(scheduler_t *scheduler) {
+    memset(scheduler, 0, sizeof(*scheduler));
+    set_weights(scheduler, default_weights);
+    pthread_mutex_init(&scheduler->lock, NULL);
+}
+
+void scheduler_destroy(scheduler_t *scheduler) {
+    pthread_mutex_destroy(&scheduler->lock);
+}
+
+static int parse_priority_class(const char *name, priority_class_t *priority) {
+    for(int i = 0; i < PRIORITY_CLASSES; i++) {
+        if(strcasecmp(name, priority_class_names[i]) == 0) {
+            *priority = (priority_class_t)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int scheduler_set_weights(scheduler_t *scheduler, const char *spec) {
+    unsigned int parsed[PRIORITY_CLASSES];
+    const char *s = spec;
+    char *endptr;
+
+    for(int i = 0; i < PRIORITY_CLASSES; i++) {
+        parsed[i] = (unsigned int)strtoul(s, &endptr, 10);
+        if(endptr == s || parsed[i] == 0 || parsed[i] > MAX_WEIGHT)
+            return -1;
+        if(i < PRIORITY_CLASSES - 1) {
+            if(*endptr != ',')
+                return -1;
+            s = endptr + 1;
+        }
+    }
+    if(*endptr != '\0')
+        return -1;
+
+    set_weights(scheduler, parsed);
+    return 0;
+}
+
+int scheduler_add_rule(scheduler_t *scheduler, const char *spec) {
+    if(scheduler->rules_count == MAX_CLASSIFICATION_RULES) {
+        fprintf(stderr, "error: too many priority rules (max %d)\n", MAX_CLASSIFICATION_RULES);
+        return -1;
+    }
+
+    classification_rule_t *rule = &scheduler->rules[scheduler->rules_count];
+    memset(rule, 0, sizeof(*rule));
+
+    const char *colon = strchr(spec, ':');
+    if(colon != NULL) {
+        if((size_t)(colon - spec) >= sizeof(rule->method))
+            return -1;
+        memcpy(rule->method, spec, colon - spec);
+        spec = colon + 1;
+    }
+
+    const char *equal = strchr(spec, '=');
+    if(spec[0] != '/' || equal == NULL || (size_t)(equal - spec) >= sizeof(rule->prefix))
+        return -1;
+    memcpy(rule->prefix, spec, equal - spec);
+    if(parse_priority_class(equal + 1, &rule->priority) != 0)
+        return -1;
+
+    scheduler->rules_count++;
+    return 0;
+}
+
+priority_class_t scheduler_classify(const scheduler_t *scheduler, const char *priority_header, const char *method,
+                                    const char *url) {
+    priority_class_t priority;
+
+    if(priority_header != NULL && parse_priority_class(priority_header, &priority) == 0)
+        return priority;
+
+    for(int i = 0; i < scheduler->rules_count; i++) {
+        const classification_rule_t *rule = &scheduler->rules[i];
+        if(rule->method[0] != '\0' && strcmp(rule->method, method) != 0)
+            continue;
+        // Whole path segments only, like the other /prefix= options: /cmd covers /cmd/on but not /cmdlog
+        size_t length = strlen(rule->prefix);
+        if(strncmp(url, rule->prefix, length) == 0
+           && (url[length] == '\0' || url[length] == '/' || rule->prefix[length - 1] == '/'))
+            return rule->priority;
+    }
+
+    return PRIORITY_NORMAL;
+}
+
+void scheduler_submit(exchange_t *exchange) {
+    http2coap_context_t *context = exchange->context;
+    scheduler_t *scheduler = &context->scheduler;
+    class_queue_t *queue = &scheduler->queues[exchange->priority];
+
+    pthread_mutex_lock(&scheduler->lock);
+    // Self-clocked fair queueing: a class starts from the current virtual time unless it is already backlogged
+    uint64_t start_tag = queue->last_finish_tag > scheduler->virtual_time ? queue->last_finish_tag
+                                                                           : scheduler->virtual_time;
+    exchange->finish_tag = start_tag + scheduler->cost / scheduler->weights[exchange->priority];
+    queue->last_finish_tag = exchange->finish_tag;
+
+    coap_ticks(&exchange->enqueued_at);
+    if(exchange->deadline == 0) {
+        uint64_t timeout_ms = context->config.request_timeout_max_ms;
+        exchange->deadline = exchange->enqueued_at + (coap_tick_t)(timeout_ms * COAP_TICKS_PER_SECOND / 1000);
+    }
+    exchange->state = EXCHANGE_QUEUED;
+    TRACE_EVENT(exchange, "queued");
+    exchange->next = NULL;
+    if(queue->tail)
+        queue->tail->next = exchange;
+    else
+        queue->head = exchange;
+    queue->tail = exchange;
+    queue->queued++;
+    pthread_mutex_unlock(&scheduler->lock);
+
+    coap_client_wakeup(context);
+}
+
+exchange_t *scheduler_next(scheduler_t *scheduler) {
+    class_queue_t *queue = NULL;
+
+    pthread_mutex_lock(&scheduler->lock);
+    for(int i = 0; i < PRIORITY_CLASSES; i++) {
+        class_queue_t *candidate = &scheduler->queues[i];
+        if(candidate->head != NULL && (queue == NULL || candidate->head->finish_tag < queue->head->finish_tag))
+            queue = candidate;
+    }
+
+    exchange_t *exchange = NULL;
+    if(queue != NULL) {
+        exchange = queue->head;
+        queue->head = exchange->next;
+        if(queue->head == NULL)
+            queue->tail = NULL;
+        exchange->next = NULL;
+        scheduler->virtual_time = exchange->finish_tag;
+
+        coap_tick_t now;
+        coap_ticks(&now);
+        exchange->queue_delay = now - exchange->enqueued_at;
+        queue->queued--;
+        queue->dispatched++;
+        queue->total_delay += exchange->queue_delay;
+        if(exchange->queue_delay > queue->max_delay)
+            queue->max_delay = exchange->queue_delay;
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+
+    if(exchange != NULL)
+        TRACE_EVENT(exchange, "dequeued");
+    return exchange;
+}
+
+// Unlinks exchange from queue, which must be locked, previous is NULL for the head
+// The finish tags given out to the exchanges removed are taken back, so that a class that had requests cancelled
+// does not wait behind the service they never got
+static void unlink_exchange(scheduler_t *scheduler, class_queue_t *queue, exchange_t *previous, exchange_t *exchange) {
+    if(previous)
+        previous->next = exchange->next;
+    else
+        queue->head = exchange->next;
+    if(queue->tail == exchange)
+        queue->tail = previous;
+    exchange->next = NULL;
+    queue->queued--;
+    queue->last_finish_tag = queue->tail != NULL ? queue->tail->finish_tag : scheduler->virtual_time;
+}
+
+int scheduler_cancel(exchange_t *exchange) {
+    scheduler_t *scheduler = &exchange->context->scheduler;
+    int found = 0;
+
+    pthread_mutex_lock(&scheduler->lock);
+    class_queue_t *queue = &scheduler->queues[exchange->priority];
+    for(exchange_t *previous = NULL, *e = queue->head; e != NULL; previous = e, e = e->next) {
+        if(e == exchange) {
+            unlink_exchange(scheduler, queue, previous, e);
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+
+    return found;
+}
+
+exchange_t *scheduler_sweep(scheduler_t *scheduler, int (*should_drop)(exchange_t *exchange, void *arg), void *arg) {
+    exchange_t *dropped = NULL;
+
+    pthread_mutex_lock(&scheduler->lock);
+    for(int i = 0; i < PRIORITY_CLASSES; i++) {
+        exchange_t *previous = NULL, *e = scheduler->queues[i].head;
+        while(e != NULL) {
+            exchange_t *next = e->next;
+            if(should_drop(e, arg)) {
+                unlink_exchange(scheduler, &scheduler->queues[i], previous, e);
+                e->next = dropped;
+                dropped = e;
+            }
+            else {
+                previous = e;
+            }
+            e = next;
+        }
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+
+    return dropped;
+}
+
+size_t scheduler_format_stats(scheduler_t *scheduler, char *buf, size_t size) {
+    size_t length = 0;
+    int written = snprintf(buf, size, "class\tweight\tqueued\tdispatched\tavg_delay_ms\tmax_delay_ms\n");
+    if(written < 0 || (size_t)written >= size)
+        return 0;
+    length = (size_t)written;
+
+    pthread_mutex_lock(&scheduler->lock);
+    for(int i = 0; i < PRIORITY_CLASSES && length < size; i++) {
+        const class_queue_t *queue = &scheduler->queues[i];
+        double avg_delay = queue->dispatched
+                           ? (double)queue->total_delay * 1000.0 / COAP_TICKS_PER_SECOND / queue->dispatched : 0.0;
+        double max_delay = (double)queue->max_delay * 1000.0 / COAP_TICKS_PER_SECOND;
+        written = snprintf(buf + length, size - length, "%s\t%u\t%u\t%lu\t%.1f\t%.1f\n", priority_class_names[i],
+                           scheduler->weights[i], queue->queued, queue->dispatched, avg_delay, max_delay);
+        if(written < 0 || (size_t)written >= size - length)
+            break;
+        length += (size_t)written;
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+
+    return length;
+}
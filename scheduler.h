@@ -0,0 +1,67 @@
+#ifndef HTTP2COAP_SCHEDULER_H
+#define HTTP2COAP_SCHEDULER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "exchange.h"
+
+extern const char *priority_class_names[PRIORITY_CLASSES];
+
+typedef struct {
+    char method[8];     // empty matches any method
+    char prefix[64];
+    priority_class_t priority;
+} classification_rule_t;
+
+typedef struct {
+    exchange_t *head, *tail;
+    uint64_t last_finish_tag;
+    // statistics
+    unsigned int queued;
+    unsigned long dispatched;
+    coap_tick_t total_delay;
+    coap_tick_t max_delay;
+} class_queue_t;
+
+#define MAX_CLASSIFICATION_RULES 16
+
+// Weighted fair queues in front of the upstream of one context
+typedef struct {
+    unsigned int weights[PRIORITY_CLASSES];
+    uint64_t cost;      // virtual time of one exchange at weight 1, a multiple of every weight
+    classification_rule_t rules[MAX_CLASSIFICATION_RULES];
+    int rules_count;
+
+    pthread_mutex_t lock;
+    class_queue_t queues[PRIORITY_CLASSES];
+    uint64_t virtual_time;
+} scheduler_t;
+
+void scheduler_init(scheduler_t *scheduler);
+void scheduler_destroy(scheduler_t *scheduler);
+
+// Weights of the high, normal and bulk classes given as "high,normal,bulk"
+int scheduler_set_weights(scheduler_t *scheduler, const char *spec);
+// Classification rule "[METHOD:]/prefix=class", first matching rule wins
+int scheduler_add_rule(scheduler_t *scheduler, const char *spec);
+
+// priority_header is the value of the priority header of the request, if any
+priority_class_t scheduler_classify(const scheduler_t *scheduler, const char *priority_header, const char *method,
+                                    const char *url);
+
+// Queue an exchange for the upstream of its context, may be called from any thread
+void scheduler_submit(exchange_t *exchange);
+// Dequeue the exchange to send next (lowest virtual finish time) or NULL, called from the CoAP thread
+exchange_t *scheduler_next(scheduler_t *scheduler);
+
+// Remove a queued exchange, returns 0 if it was not queued
+int scheduler_cancel(exchange_t *exchange);
+// Remove every queued exchange for which should_drop() returns non-zero and return them as a list linked
+// through their next field, called from the CoAP thread
+exchange_t *scheduler_sweep(scheduler_t *scheduler, int (*should_drop)(exchange_t *exchange, void *arg), void *arg);
+
+// Writes per-class queueing statistics as text, returns the length written
+size_t scheduler_format_stats(scheduler_t *scheduler, char *buf, size_t size);
+
+#endif //HTTP2COAP_SCHEDULER_H
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "trace.h"
+
+double trace_sample_rate = 0;
+
+static FILE *trace_file = NULL;
+static unsigned long traces_written = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+int trace_open(const char *path) {
+    trace_file = fopen(path, "w");
+    if(trace_file == NULL) {
+        perror(path);
+        return -1;
+    }
+    // JSON array format, the closing bracket is optional so that a killed proxy still leaves a usable file
+    fputs("[\n", trace_file);
+    fflush(trace_file);
+    return 0;
+}
+
+void trace_close(void) {
+    pthread_mutex_lock(&trace_lock);
+    if(trace_file != NULL) {
+        fputs("\n]\n", trace_file);
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+int trace_sampled(void) {
+    if(trace_sample_rate <= 0 || trace_file == NULL)
+        return 0;
+    return trace_sample_rate >= 1 || (double)random() / RAND_MAX < trace_sample_rate;
+}
+
+trace_t *trace_start(arena_t *arena, const char *url) {
+    trace_t *trace = arena_alloc(arena, sizeof(trace_t));
+    if(trace == NULL)
+        return NULL;
+    size_t url_length = strlen(url) + 1;
+    char *url_copy = arena_alloc(arena, url_length);
+    trace->url = url_copy != NULL ? memcpy(url_copy, url, url_length) : "";
+    snprintf(trace->id, sizeof(trace->id), "%08lx%08lx",
+             (unsigned long)random() & 0xffffffffUL, (unsigned long)random() & 0xffffffffUL);
+    trace->event_count = 0;
+    trace_record(trace, "accept");
+    return trace;
+}
+
+// The HTTP and CoAP threads may both record on the same exchange, each event takes a slot of its own
+void trace_record(trace_t *trace, const char *name) {
+    unsigned int slot = __sync_fetch_and_add(&trace->event_count, 1);
+    // Past the limit (a storm of retransmissions), later events are dropped
+    if(slot >= TRACE_MAX_EVENTS)
+        return;
+    trace->events[slot].name = name;
+    trace->events[slot].timestamp_us = trace_now();
+}
+
+static void write_json_string(FILE *file, const char *s) {
+    for(; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if(c == '"' || c == '\\')
+            fprintf(file, "\\%c", c);
+        else if(c < 0x20 || c >= 0x7f)
+            fprintf(file, "\\u%04x", c);
+        else
+            fputc(c, file);
+    }
+}
+
+// One complete event spanning the whole exchange, and one instant event per step, all on a lane of their own
+void trace_finish(trace_t *trace, unsigned int http_code) {
+    pthread_mutex_lock(&trace_lock);
+    if(trace_file == NULL) {
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+    unsigned long lane = ++traces_written;
+    unsigned int event_count = trace->event_count < TRACE_MAX_EVENTS ? trace->event_count : TRACE_MAX_EVENTS;
+    const trace_event_t *first = &trace->events[0], *last = &trace->events[event_count - 1];
+
+    fputs(lane > 1 ? ",\n{\"name\":\"" : "{\"name\":\"", trace_file);
+    write_json_string(trace_file, trace->url);
+    fprintf(trace_file, "\",\"cat\":\"exchange\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":1,\"tid\":%lu,"
+                        "\"args\":{\"trace_id\":\"%s\",\"status\":%u}}",
+            (unsigned long long)first->timestamp_us,
+            (unsigned long long)(last->timestamp_us - first->timestamp_us), lane, trace->id, http_code);
+    for(unsigned int i = 0; i < event_count; i++) {
+        fprintf(trace_file, ",\n{\"name\":\"%s\",\"cat\":\"exchange\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%llu,"
+                            "\"pid\":1,\"tid\":%lu}",
+                trace->events[i].name, (unsigned long long)trace->events[i].timestamp_us, lane);
+    }
+    fflush(trace_file);
+    pthread_mutex_unlock(&trace_lock);
+}
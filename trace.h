@@ -0,0 +1,42 @@
+#ifndef HTTP2COAP_TRACE_H
+#define HTTP2COAP_TRACE_H
+
+#include <stdint.h>
+#include "arena.h"
+
+// Response header echoing the identifier of a sampled exchange, to find it back in the trace file
+#define TRACE_HEADER "X-Trace-Id"
+#define TRACE_MAX_EVENTS 24
+
+typedef struct {
+    const char *name;           // string literal
+    uint64_t timestamp_us;      // monotonic clock
+} trace_event_t;
+
+// Timeline of one sampled exchange, lives in the arena of the exchange
+typedef struct trace_t {
+    char id[17];
+    const char *url;
+    unsigned int event_count;   // slots taken, may run past TRACE_MAX_EVENTS
+    trace_event_t events[TRACE_MAX_EVENTS];
+} trace_t;
+
+// Fraction of the HTTP requests that are traced, tracing is off when 0
+extern double trace_sample_rate;
+
+// Where sampled exchanges are appended as Chrome trace events (chrome://tracing, Perfetto)
+int trace_open(const char *path);
+void trace_close(void);
+
+// Whether the request that just came in should be traced
+int trace_sampled(void);
+trace_t *trace_start(arena_t *arena, const char *url);
+void trace_record(trace_t *trace, const char *name);
+// Writes the timeline out once nothing can happen to the exchange anymore, the trace goes away with its arena
+void trace_finish(trace_t *trace, unsigned int http_code);
+
+// Costs a single test for exchanges that are not sampled
+#define TRACE_EVENT(exchange, name) \
+    do { if((exchange)->trace != NULL) trace_record((exchange)->trace, (name)); } while(0)
+
+#endif //HTTP2COAP_TRACE_H